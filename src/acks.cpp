@@ -0,0 +1,119 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "acks.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_PSH 0x08
+#define TCP_OPTION_SACK 5
+
+AckThinner::AckThinner()
+{
+    thinned = 0;
+}
+
+static int ipHeaderSize(const char *packet)
+{
+    return (packet[0] & 0x0f) * 4;
+}
+
+bool AckThinner::thinnable(const char *packet, int length)
+{
+    if (length < 40 || ((uint8_t)packet[0] >> 4) != 4 || packet[9] != IPPROTO_TCP)
+        return false;
+
+    uint16_t totalLength, fragment;
+    memcpy(&totalLength, packet + 2, sizeof(totalLength));
+    memcpy(&fragment, packet + 6, sizeof(fragment));
+    if (ntohs(totalLength) != length || (ntohs(fragment) & 0x3fff))
+        return false;
+
+    // nothing but the ack flag, apart from push and the ecn flags
+    const char *tcp = packet + ipHeaderSize(packet);
+    int tcpHeaderSize = ((uint8_t)tcp[12] >> 4) * 4;
+    if (tcpHeaderSize < 20 || ipHeaderSize(packet) + tcpHeaderSize != length ||
+        (tcp[13] & 0x3f & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+        return false;
+
+    for (int i = 20; i < tcpHeaderSize; )
+    {
+        if (tcp[i] == 0)
+            break;
+        if (tcp[i] == 1)
+        {
+            i++;
+            continue;
+        }
+        if (tcp[i] == TCP_OPTION_SACK || i + 1 >= tcpHeaderSize || (uint8_t)tcp[i + 1] < 2)
+            return false;
+
+        i += (uint8_t)tcp[i + 1];
+    }
+
+    return true;
+}
+
+bool AckThinner::sameFlow(const char *packet, const char *other)
+{
+    return memcmp(packet + 12, other + 12, 8) == 0 && // addresses
+           memcmp(packet + ipHeaderSize(packet), other + ipHeaderSize(other), 4) == 0 && // ports
+           (packet[ipHeaderSize(packet) + 13] & 0xc0) == (other[ipHeaderSize(other) + 13] & 0xc0);
+}
+
+uint32_t AckThinner::ackNumber(const char *packet)
+{
+    uint32_t ack;
+    memcpy(&ack, packet + ipHeaderSize(packet) + 8, sizeof(ack));
+    return ntohl(ack);
+}
+
+void AckThinner::hold(const char *packet, int length)
+{
+    // only the last ack of the flow may be replaced, the ones before it
+    // have been followed by a duplicate
+    for (std::deque<std::vector<char> >::reverse_iterator it = held.rbegin(); it != held.rend(); ++it)
+    {
+        if (!sameFlow(&(*it)[0], packet))
+            continue;
+
+        if ((int32_t)(ackNumber(packet) - ackNumber(&(*it)[0])) > 0)
+        {
+            it->assign(packet, packet + length);
+            thinned++;
+            return;
+        }
+        break;
+    }
+
+    held.push_back(std::vector<char>(packet, packet + length));
+}
+
+bool AckThinner::release(std::vector<char> &packet)
+{
+    if (held.empty())
+        return false;
+
+    packet.swap(held.front());
+    held.pop_front();
+    return true;
+}
@@ -0,0 +1,54 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ACKS_H
+#define ACKS_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+
+// holds the pure tcp acks of a burst read from the tunnel device, an ack is
+// replaced by a later one of the same flow that acknowledges more. duplicate
+// acks and acks carrying sack blocks are all passed on, so loss recovery of
+// the hosts works as before.
+class AckThinner
+{
+public:
+    AckThinner();
+
+    static bool thinnable(const char *packet, int length); // pure ack without sack
+
+    void hold(const char *packet, int length); // a thinnable packet
+    bool release(std::vector<char> &packet);   // in the order they were held
+
+    bool isEmpty() const { return held.empty(); }
+
+    unsigned int getThinned() const { return thinned; }
+
+protected:
+    static bool sameFlow(const char *packet, const char *other);
+    static uint32_t ackNumber(const char *packet);
+
+    std::deque<std::vector<char> > held;
+
+    unsigned int thinned;
+};
+
+#endif
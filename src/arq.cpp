@@ -0,0 +1,271 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "arq.h"
+#include "config.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+Arq::Arq()
+{
+    firstSeq = 0;
+    nextSeq = 0;
+
+    expectedSeq = 0;
+    highestSeq = 0;
+    received.assign(ARQ_WINDOW, false);
+    framesUnacked = 0;
+
+    retransmitted = 0;
+    duplicates = 0;
+    windowFull = 0;
+}
+
+int Arq::writeHeader(char *payload, uint16_t seq)
+{
+    Header *header = (Header *)payload;
+    header->seq = htons(seq);
+    header->ack = htons(expectedSeq);
+
+    // report the ranges received beyond the gap, lowest first
+    SackBlock *blocks = (SackBlock *)(payload + sizeof(Header));
+    int count = 0;
+
+    uint16_t current = expectedSeq + 1;
+    while (count < MAX_SACK_BLOCKS && !before(highestSeq, current))
+    {
+        if (!received[current % ARQ_WINDOW])
+        {
+            current++;
+            continue;
+        }
+
+        blocks[count].start = htons(current);
+        while (!before(highestSeq, current) && received[current % ARQ_WINDOW])
+            current++;
+        blocks[count].end = htons(current);
+        count++;
+    }
+
+    header->blocks = htons(count);
+
+    framesUnacked = 0;
+
+    return sizeof(Header) + count * sizeof(SackBlock);
+}
+
+bool Arq::canSend() const
+{
+    return frames.size() < ARQ_WINDOW;
+}
+
+int Arq::encodeData(char *payload, int length, int type, const Time &now)
+{
+    if (frames.size() == ARQ_WINDOW)
+    {
+        windowFull++;
+        return 0;
+    }
+
+    frames.push_back(Frame());
+    Frame &frame = frames.back();
+    frame.data.assign(payload, payload + length);
+    frame.type = type;
+    frame.sent = now;
+    frame.transmissions = 1;
+    frame.sacked = false;
+
+    // the header has a variable size, so leave room for the largest one
+    memmove(payload + overhead(), payload, length);
+    int headerLength = writeHeader(payload, nextSeq);
+    memmove(payload + headerLength, payload + overhead(), length);
+
+    nextSeq++;
+
+    return headerLength + length;
+}
+
+int Arq::encodeAck(char *payload)
+{
+    return writeHeader(payload, nextSeq);
+}
+
+void Arq::frameDelivered(Frame &frame, const Time &now)
+{
+    // karn: retransmitted frames give ambiguous samples
+    if (frame.transmissions == 1)
+        rtt.addSample(now - frame.sent, now);
+
+    if (latestDelivered < frame.sent)
+        latestDelivered = frame.sent;
+
+    frame.sacked = true;
+}
+
+int Arq::decode(char *payload, int length, bool data, const Time &now)
+{
+    if (length < sizeof(Header))
+        return -1;
+
+    Header *header = (Header *)payload;
+    int blockCount = ntohs(header->blocks);
+    int headerLength = sizeof(Header) + blockCount * sizeof(SackBlock);
+
+    if (blockCount > MAX_SACK_BLOCKS || length < headerLength)
+        return -1;
+
+    // acknowledgements for the frames we sent
+    uint16_t ack = ntohs(header->ack);
+    if (!before(nextSeq, ack))
+    {
+        while (frames.size() > 0 && before(firstSeq, ack))
+        {
+            if (!frames.front().sacked)
+                frameDelivered(frames.front(), now);
+
+            frames.pop_front();
+            firstSeq++;
+        }
+    }
+
+    SackBlock *blocks = (SackBlock *)(payload + sizeof(Header));
+    for (int i = 0; i < blockCount; i++)
+    {
+        uint16_t start = ntohs(blocks[i].start);
+        uint16_t end = ntohs(blocks[i].end);
+
+        for (uint16_t seq = start; before(seq, end); seq++)
+        {
+            uint16_t index = seq - firstSeq;
+            if (index >= frames.size())
+                break;
+
+            if (!frames[index].sacked)
+                frameDelivered(frames[index], now);
+        }
+    }
+
+    if (!data)
+        return 0;
+
+    // the data frame itself
+    uint16_t seq = ntohs(header->seq);
+    uint16_t offset = seq - expectedSeq;
+
+    if (framesUnacked == 0)
+        firstUnacked = now;
+    framesUnacked++;
+
+    if (before(seq, expectedSeq) || offset >= ARQ_WINDOW ||
+        (offset != 0 && received[seq % ARQ_WINDOW]))
+    {
+        duplicates++;
+        return -1;
+    }
+
+    if (offset == 0)
+    {
+        expectedSeq++;
+        while (received[expectedSeq % ARQ_WINDOW])
+        {
+            received[expectedSeq % ARQ_WINDOW] = false;
+            expectedSeq++;
+        }
+    }
+    else
+    {
+        received[seq % ARQ_WINDOW] = true;
+    }
+
+    if (before(highestSeq, seq))
+        highestSeq = seq;
+
+    length -= headerLength;
+    memmove(payload, payload + headerLength, length);
+
+    return length;
+}
+
+Time Arq::lossDeadline(const Frame &frame) const
+{
+    // a frame sent before one which got through is lost after a reordering
+    // window, any other after the backed off retransmission timeout
+    if (rtt.hasSamples() && frame.sent < latestDelivered)
+        return frame.sent + rtt.srtt() + Time(rtt.srtt().milliseconds() / 4 + MIN_REORDER_WINDOW);
+
+    int timeout = rtt.rto().milliseconds();
+    for (int i = 1; i < frame.transmissions && timeout < RTO_MAX; i++)
+        timeout *= 2;
+    if (timeout > RTO_MAX)
+        timeout = RTO_MAX;
+
+    return frame.sent + timeout;
+}
+
+int Arq::retransmit(char *payload, int &type, const Time &now)
+{
+    for (deque<Frame>::iterator frame = frames.begin(); frame != frames.end(); ++frame)
+    {
+        if (frame->sacked || now < lossDeadline(*frame))
+            continue;
+
+        frame->sent = now;
+        frame->transmissions++;
+        retransmitted++;
+
+        int headerLength = writeHeader(payload, firstSeq + (frame - frames.begin()));
+        memcpy(payload + headerLength, &frame->data[0], frame->data.size());
+        type = frame->type;
+
+        return headerLength + frame->data.size();
+    }
+
+    return 0;
+}
+
+bool Arq::ackDue(const Time &now) const
+{
+    if (framesUnacked == 0)
+        return false;
+
+    return framesUnacked >= ARQ_ACK_FRAMES || !(now < firstUnacked + ARQ_ACK_DELAY);
+}
+
+Time Arq::deadline() const
+{
+    Time deadline;
+
+    if (framesUnacked > 0)
+        deadline = firstUnacked + ARQ_ACK_DELAY;
+
+    for (deque<Frame>::const_iterator frame = frames.begin(); frame != frames.end(); ++frame)
+    {
+        if (frame->sacked)
+            continue;
+
+        Time frameDeadline = lossDeadline(*frame);
+        if (deadline == Time::ZERO || frameDeadline < deadline)
+            deadline = frameDeadline;
+    }
+
+    return deadline;
+}
@@ -0,0 +1,108 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ARQ_H
+#define ARQ_H
+
+#include "time.h"
+#include "rtt.h"
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+// selective repeat arq. data frames carry a sequence number and every frame
+// acknowledges the data received so far, cumulatively and with ranges
+// received beyond the first gap. frames are passed on as they arrive, only
+// duplicates are dropped.
+class Arq
+{
+public:
+    struct Header
+    {
+        uint16_t seq;    // only used in data frames
+        uint16_t ack;    // next sequence number expected
+        uint16_t blocks; // number of sack blocks following
+    }; // size = 6
+
+    struct SackBlock
+    {
+        uint16_t start;
+        uint16_t end;    // first sequence number not included
+    }; // size = 4
+
+    static const int MAX_SACK_BLOCKS = 3;
+
+    static int overhead() { return sizeof(Header) + MAX_SACK_BLOCKS * sizeof(SackBlock); }
+
+    Arq();
+
+    // type is what the frame is sent as, it is returned with the retransmissions
+    int encodeData(char *payload, int length, int type, const Time &now); // 0 if the window is full
+    int encodeAck(char *payload);
+    int decode(char *payload, int length, bool data, const Time &now); // -1 if not new data
+    int retransmit(char *payload, int &type, const Time &now); // 0 if nothing is lost
+
+    bool canSend() const; // the window has room for another frame
+
+    bool ackDue(const Time &now) const;
+    Time deadline() const;
+
+    unsigned int getRetransmitted() const { return retransmitted; }
+    unsigned int getDuplicates() const { return duplicates; }
+    unsigned int getWindowFull() const { return windowFull; }
+    int getInFlight() const { return frames.size(); }
+    const RttEstimator &getRtt() const { return rtt; }
+
+protected:
+    struct Frame
+    {
+        std::vector<char> data;
+        int type;
+        Time sent;
+        int transmissions;
+        bool sacked;
+    };
+
+    static bool before(uint16_t a, uint16_t b) { return (int16_t)(a - b) < 0; }
+
+    int writeHeader(char *payload, uint16_t seq);
+    void frameDelivered(Frame &frame, const Time &now);
+    Time lossDeadline(const Frame &frame) const;
+
+    // sender
+    std::deque<Frame> frames; // unacknowledged, starting at firstSeq
+    uint16_t firstSeq;
+    uint16_t nextSeq;
+    Time latestDelivered;     // send time of the latest frame known to be delivered
+    RttEstimator rtt;
+
+    // receiver
+    uint16_t expectedSeq;
+    uint16_t highestSeq;
+    std::vector<bool> received; // frames after expectedSeq, by seq % window
+    int framesUnacked;
+    Time firstUnacked;
+
+    unsigned int retransmitted;
+    unsigned int duplicates;
+    unsigned int windowFull;
+};
+
+#endif
@@ -22,6 +22,8 @@
 
 #include <arpa/inet.h>
 
+using namespace std;
+
 Auth::Auth(const char *passphrase)
 {
     this->passphrase = passphrase;
@@ -30,6 +32,9 @@ Auth::Auth(const char *passphrase)
     crypto_hash_sha256(this->encryptionkey, (const unsigned char*)passphrase, this->passphrase.length());
     for (int i=0;i<65535;++i)
         crypto_hash_sha256(this->encryptionkey, (const unsigned char*)this->encryptionkey, crypto_hash_sha256_BYTES);
+
+    // a separate key for the macs, one more step down the chain
+    crypto_hash_sha256(this->proofkey, this->encryptionkey, crypto_hash_sha256_BYTES);
 }
 
 Auth::Response Auth::getResponse(const Challenge &challenge) const
@@ -46,6 +51,38 @@ Auth::Response Auth::getResponse(const Challenge &challenge) const
     return response;
 }
 
+vector<unsigned char> Auth::getProofInput(uint64_t nonce, uint32_t timestamp,
+                                         const char *data, int length) const
+{
+    vector<unsigned char> input(sizeof(nonce) + sizeof(timestamp) + length);
+
+    nonce = Utility::htonll(nonce);
+    timestamp = htonl(timestamp);
+    memcpy(&input[0], &nonce, sizeof(nonce));
+    memcpy(&input[sizeof(nonce)], &timestamp, sizeof(timestamp));
+    memcpy(&input[sizeof(nonce) + sizeof(timestamp)], data, length);
+
+    return input;
+}
+
+Auth::Proof Auth::getProof(uint64_t nonce, uint32_t timestamp, const char *data, int length) const
+{
+    vector<unsigned char> input = getProofInput(nonce, timestamp, data, length);
+
+    Proof proof;
+    proof.timestamp = htonl(timestamp);
+    crypto_auth_hmacsha256(proof.mac, &input[0], input.size(), proofkey);
+
+    return proof;
+}
+
+bool Auth::checkProof(const Proof &proof, uint64_t nonce, const char *data, int length) const
+{
+    vector<unsigned char> input = getProofInput(nonce, ntohl(proof.timestamp), data, length);
+
+    return crypto_auth_hmacsha256_verify(proof.mac, &input[0], input.size(), proofkey) == 0;
+}
+
 Auth::Challenge Auth::generateChallenge(int length) const
 {
     Challenge challenge;
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <nacl/crypto_hash_sha256.h>
+#include <nacl/crypto_auth_hmacsha256.h>
 
 class Auth
 {
@@ -37,10 +38,20 @@ public:
         bool operator==(const Response &other) const { return memcmp(this, &other, sizeof(Response)) == 0; }
     };
 
+    // sent with a connection request instead of answering a challenge
+    struct Proof
+    {
+        uint32_t timestamp;
+        unsigned char mac[crypto_auth_hmacsha256_BYTES];
+    }; // size = 36
+
     Auth(const char *passphrase);
 
     Challenge generateChallenge(int length) const;
     Response getResponse(const Challenge &challenge) const;
+
+    Proof getProof(uint64_t nonce, uint32_t timestamp, const char *data, int length) const;
+    bool checkProof(const Proof &proof, uint64_t nonce, const char *data, int length) const;
     unsigned char *getEncryptionKey() {return encryptionkey;}
     int getEncryptionKeyLength() { return crypto_hash_sha256_BYTES; }
 
@@ -48,6 +59,10 @@ protected:
     std::string passphrase;
     std::string challenge;
     unsigned char encryptionkey[crypto_hash_sha256_BYTES];
+    unsigned char proofkey[crypto_hash_sha256_BYTES];
+
+    std::vector<unsigned char> getProofInput(uint64_t nonce, uint32_t timestamp,
+                                             const char *data, int length) const;
 };
 
 #endif
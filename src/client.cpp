@@ -22,23 +22,29 @@
 #include "exception.h"
 #include "config.h"
 #include "utility.h"
+#include "ticket.h"
 
 #include <cstdio>
 #include <string.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <syslog.h>
+#include <time.h>
+#include <algorithm>
 
 using namespace std;
 
 const Worker::TunnelHeader::Magic Client::magic("hanc");
 
-Client::Client(int tunnelMtu, const char *deviceName, uint32_t serverIp,
+Client::Client(int tunnelMtu, const char *deviceName, const vector<vector<uint32_t> > &servers,
                int maxPolls, const char *passphrase, uid_t uid, gid_t gid,
                bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp)
-: Worker(tunnelMtu, deviceName, false, uid, gid), auth(passphrase)
+: Worker(tunnelMtu, deviceName, false, uid, gid), auth(passphrase), scheduler(servers[0].size())
 {
-    this->serverIp = serverIp;
+    this->servers = servers;
+    this->currentServer = 0;
+    this->serverIps = servers[0];
+    this->handshakePath = serverIps.size() - 1;
     this->clientIp = INADDR_NONE;
     this->desiredIp = desiredIp;
     this->maxPolls = maxPolls;
@@ -46,6 +52,22 @@ Client::Client(int tunnelMtu, const char *deviceName, uint32_t serverIp,
     this->changeEchoId = changeEchoId;
     this->changeEchoSeq = changeEchoSeq;
     this->nextEchoSequence = Utility::rand();
+    this->reorderHoldPercent = 0;
+    this->arqEnabled = false;
+    this->compression = false;
+    this->headerCompression = false;
+    this->relaying = false;
+    this->offerVersion2 = true;
+    this->serverUdpPort = 0;
+    this->udpActive = false;
+    this->echoIdIndex = 0;
+    this->echoIdProbes = 0;
+    this->silenceProbes = 0;
+
+    // a step by a prime keeps the ids apart
+    if (changeEchoId)
+        for (int i = 1; i < ECHO_ID_POOL_SIZE; i++)
+            echoIds.push_back(nextEchoId + i * 38543);
 
     state = STATE_CLOSED;
 }
@@ -55,27 +77,204 @@ Client::~Client()
 
 }
 
-void Client::sendConnectionRequest()
+void Client::setInterfaces(const vector<string> &interfaces)
+{
+    echo->bindSockets(interfaces);
+
+    scheduler = PathScheduler(interfaces.size() * serverIps.size());
+    handshakePath = scheduler.size() - 1;
+}
+
+int Client::writeConnectData(const Auth::Challenge *challenge, bool prove)
 {
     Server::ClientConnectData *connectData = (Server::ClientConnectData *)echoSendPayloadBuffer();
     connectData->maxPolls = maxPolls;
+    connectData->flags = arqEnabled ? Server::ClientConnectData::FLAG_ARQ : 0;
+    if (compression)
+        connectData->flags |= Server::ClientConnectData::FLAG_COMPRESSION;
+    if (headerCompression)
+        connectData->flags |= Server::ClientConnectData::FLAG_HEADER_COMPRESSION;
+    if (relaying)
+        connectData->flags |= Server::ClientConnectData::FLAG_STREAMS;
+    if (offerVersion2)
+        connectData->flags |= Server::ClientConnectData::FLAG_VERSION_2;
     connectData->desiredIp = desiredIp;
+    connectData->echoIds = echoIds.size();
+    connectData->routes = routes.size();
+
+    int dataLength = sizeof(Server::ClientConnectData);
+
+    for (int i = 0; i < echoIds.size(); i++)
+    {
+        uint16_t id = htons(echoIds[i]);
+        memcpy(echoSendPayloadBuffer() + dataLength, &id, sizeof(id));
+        dataLength += sizeof(id);
+    }
+
+    for (int i = 0; i < routes.size(); i++)
+    {
+        uint32_t network = htonl(routes[i].network);
+        memcpy(echoSendPayloadBuffer() + dataLength, &network, sizeof(network));
+        echoSendPayloadBuffer()[dataLength + sizeof(network)] = routes[i].length;
+        dataLength += Server::ClientConnectData::ROUTE_SIZE;
+    }
+
+    if (offerVersion2)
+    {
+        uint16_t mtu = htons(tunnelMtu);
+        memcpy(echoSendPayloadBuffer() + dataLength, &mtu, sizeof(mtu));
+        dataLength += sizeof(mtu);
+    }
+
+    // the server keeps nothing before we are authenticated, so the request
+    // is repeated together with the challenge and our response
+    if (challenge != NULL)
+    {
+        Auth::Response response = auth.getResponse(*challenge);
+
+        connectData->flags |= Server::ClientConnectData::FLAG_COOKIE;
+        memcpy(echoSendPayloadBuffer() + dataLength, &(*challenge)[0], challenge->size());
+        dataLength += challenge->size();
+        memcpy(echoSendPayloadBuffer() + dataLength, &response, sizeof(response));
+        dataLength += sizeof(response);
+
+        return dataLength;
+    }
 
-    syslog(LOG_DEBUG, "sending connection request");
+    if (!prove)
+        return dataLength;
 
+    // with a ticket the server accepts us right away
+    if (!ticket.empty())
+    {
+        connectData->flags |= Server::ClientConnectData::FLAG_TICKET;
+        memcpy(echoSendPayloadBuffer() + dataLength, &ticket[0], ticket.size());
+        dataLength += ticket.size();
+    }
+
+    // so does proving that we know the passphrase, which saves the challenge
+    connectData->flags |= Server::ClientConnectData::FLAG_PROOF;
+    Auth::Proof proof = auth.getProof(session.nonce, time(NULL), echoSendPayloadBuffer(), dataLength);
+    memcpy(echoSendPayloadBuffer() + dataLength, &proof, sizeof(proof));
+    dataLength += sizeof(proof);
+
+    return dataLength;
+}
+
+void Client::startSession()
+{
     // Connection request is at beginning of each connection
     // we do an initial random (to not always start nounce with same number)
     // since we do random only once in beginning 64 bit is enough
-    nonce = Utility::rand();
-    nonce <<= 32;
-    nonce += Utility::rand();
-    memcpy(key, auth.getEncryptionKey(), auth.getEncryptionKeyLength());
-    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, sizeof(Server::ClientConnectData));
+    session = Session();
+    session.nonce = Utility::rand();
+    session.nonce <<= 32;
+    session.nonce += Utility::rand();
+    memcpy(session.key, auth.getEncryptionKey(), auth.getEncryptionKeyLength());
+    session.compression = compression;
+}
+
+void Client::sendConnectionRequest()
+{
+    startSession();
 
     state = STATE_CONNECTION_REQUEST_SENT;
+    pendingPolls.clear();
+    echoIdIndex = 0;
+    confirmedEchoIds.clear();
+    nextEchoIdProbe = Time::ZERO;
+    handshakePath = (handshakePath + 1) % scheduler.size();
+
+    // connections are made over icmp, the server offers udp again
+    serverUdpPort = 0;
+    udpActive = false;
+
+    if (servers.size() > 1)
+    {
+        probeServers();
+    }
+    else
+    {
+        syslog(LOG_DEBUG, ticket.empty() ? "sending connection request" :
+                                           "sending connection request with resumption ticket");
+
+        int dataLength = writeConnectData(NULL, true);
+        sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, dataLength);
+    }
+
     setTimeout(5000);
 }
 
+void Client::probeServers()
+{
+    // a request without a proof is answered with a challenge, for which the
+    // servers keep nothing. the first one to answer is the closest and the
+    // handshake goes on with it.
+    syslog(LOG_DEBUG, "probing %d servers", (int)servers.size());
+
+    state = STATE_SERVERS_PROBED;
+    serverSessions.resize(servers.size());
+
+    for (int i = 0; i < servers.size(); i++)
+    {
+        startSession();
+        serverSessions[i] = session;
+
+        int dataLength = writeConnectData(NULL, false);
+        sendEcho(magic, TunnelHeader::TYPE_CONNECTION_REQUEST, dataLength, servers[i][0], false,
+                 nextEchoId, nextEchoSequence++, Echo::Route(), serverSessions[i]);
+    }
+}
+
+int Client::findServer(uint32_t ip)
+{
+    for (int i = 0; i < servers.size(); i++)
+        if (find(servers[i].begin(), servers[i].end(), ip) != servers[i].end())
+            return i;
+
+    return -1;
+}
+
+void Client::useServer(int server)
+{
+    syslog(LOG_INFO, "connecting to server %s", Utility::formatIp(servers[server][0]).c_str());
+
+    currentServer = server;
+    serverIps = servers[server];
+    session = serverSessions[server];
+
+    scheduler = PathScheduler(echo->socketCount() * serverIps.size());
+    handshakePath = 0;
+}
+
+Time Client::silenceDeadline()
+{
+    // polls can wait on the server, so only the rtt of probes counts
+    return (silenceProbes == 0 ? lastReceived : lastSilenceProbe) + scheduler.rto();
+}
+
+bool Client::serverSilent()
+{
+    // with other servers to go to, a silent one is probed every rto and
+    // given up after FAILOVER_PROBES probes went unanswered
+    if (now < silenceDeadline())
+        return false;
+
+    if (silenceProbes == FAILOVER_PROBES)
+    {
+        syslog(LOG_WARNING, "server %s stopped answering, failing over",
+               Utility::formatIp(servers[currentServer][0]).c_str());
+        sendConnectionRequest();
+        return true;
+    }
+
+    sendProbe(scheduler.next(now));
+    silenceProbes++;
+    lastSilenceProbe = now;
+
+    return false;
+}
+
 void Client::sendChallengeResponse(int dataLength)
 {
     if (dataLength != CHALLENGE_SIZE)
@@ -85,49 +284,107 @@ void Client::sendChallengeResponse(int dataLength)
 
     syslog(LOG_DEBUG, "sending challenge response");
 
-    vector<char> challenge;
+    Auth::Challenge challenge;
     challenge.resize(dataLength);
     memcpy(&challenge[0], echoReceivePayloadBuffer(), dataLength);
 
-    Auth::Response response = auth.getResponse(challenge);
+    // every request starts a session of its own on the server
+    startSession();
 
-    memcpy(echoSendPayloadBuffer(), (char *)&response, sizeof(Auth::Response));
-    sendEchoToServer(TunnelHeader::TYPE_CHALLENGE_RESPONSE, sizeof(Auth::Response));
+    dataLength = writeConnectData(&challenge, true);
+    sendEchoToServer(TunnelHeader::TYPE_CONNECTION_REQUEST, dataLength);
 
     setTimeout(5000);
 }
 
-bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
-                            bool reply, uint16_t id, uint16_t seq,
-                            uint64_t &client_nonce, unsigned char *client_key)
+bool Client::handleEchoData(int dataLength, uint32_t realIp, bool reply,
+                            uint16_t id, uint16_t seq, const Echo::Route &route)
 {
-    if (realIp != serverIp || !reply)
+    if (!reply)
+        return false;
+
+    // while probing every server answers in a session of its own
+    Session *receiving = &session;
+    int server = -1;
+    if (state == STATE_SERVERS_PROBED)
+    {
+        if ((server = findServer(realIp)) == -1)
+            return false;
+        receiving = &serverSessions[server];
+    }
+    else if (find(serverIps.begin(), serverIps.end(), realIp) == serverIps.end())
+        return false;
+
+    if (route.udpPort != 0 && route.udpPort != serverUdpPort)
         return false;
 
-    if (dataLength < sizeof(TunnelHeader))
+    // compact echoes are read into the original layout, decrypted already
+    bool compact = receiving->compactHeader && openCompactEcho(dataLength, true, *receiving, Server::magic);
+
+    if (dataLength < sizeof(PacketCounter) + sizeof(TunnelHeader))
         return false;
 
-    unsigned char *ciphertext = (unsigned char *)data;
-    ciphertext += sizeof(Echo::EchoHeader) + sizeof(Echo::IpHeader);
-    nonce += nextEchoSequence - lastSequence;
-    client_nonce = nonce;
-    client_key = key;
-    crypto_stream_salsa20_xor(ciphertext, ciphertext , dataLength,
-                              (const unsigned char *)&nonce, key);
+    uint32_t counter = receivedCounter();
+    if (!receiving->replayWindow.check(counter))
+    {
+        DEBUG_ONLY(printf("replayed or too old: counter %u\n", counter));
+        return true;
+    }
 
-    dataLength -= sizeof(TunnelHeader);
+    if (!compact)
+        decryptEcho(dataLength, true, receiving->nonce, receiving->key);
+    dataLength -= sizeof(PacketCounter) + sizeof(TunnelHeader);
 
-    TunnelHeader &header = *(TunnelHeader *)echo->receivePayloadBuffer();
-    DEBUG_ONLY(printf("received: type %d, length %d, id %d, seq %d\n", header->type, dataLength - sizeof(TunnelHeader), id, seq));
+    TunnelHeader &header = receivedHeader();
+    DEBUG_ONLY(printf("received: type %d, length %d, id %d, seq %d, counter %u\n", header.type, dataLength, id, seq, counter));
 
     if (header.magic != Server::magic)
         return false;
 
+    receiving->replayWindow.update(counter);
+    lastReceived = now;
+    silenceProbes = 0;
+
+    if (!decompressEcho(header, dataLength))
+        return true;
+
+    if (state == STATE_SERVERS_PROBED)
+    {
+        if (header.type != TunnelHeader::TYPE_CHALLENGE)
+            return true;
+
+        useServer(server);
+        state = STATE_CONNECTION_REQUEST_SENT;
+    }
+
+    if (state == STATE_ESTABLISHED)
+    {
+        if (header.type != TunnelHeader::TYPE_PROBE)
+            pollAnswered(seq);
+        if (route.udpPort != 0)
+            lastUdpReceived = now;
+
+        // echoes without data still take their place in the packet order
+        if (reorderHoldPercent != 0 && header.type != TunnelHeader::TYPE_DATA &&
+            header.type != TunnelHeader::TYPE_FEC_DATA && header.type != TunnelHeader::TYPE_ARQ_DATA)
+        {
+            reorderBuffer.skip(counter, now);
+            releaseReordered();
+        }
+    }
+
     switch (header.type)
     {
         case TunnelHeader::TYPE_RESET_CONNECTION:
             syslog(LOG_DEBUG, "reset reveiced");
 
+            // servers before version 2 take the longer request for an invalid one
+            if (state == STATE_CONNECTION_REQUEST_SENT && offerVersion2)
+            {
+                syslog(LOG_INFO, "server does not know version 2, falling back");
+                offerVersion2 = false;
+            }
+
             sendConnectionRequest();
             return true;
         case TunnelHeader::TYPE_SERVER_FULL:
@@ -137,20 +394,28 @@ bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
             }
             break;
         case TunnelHeader::TYPE_CHALLENGE:
-            if (state == STATE_CONNECTION_REQUEST_SENT)
+            // a repeated challenge replaces an expired one
+            if (state == STATE_CONNECTION_REQUEST_SENT || state == STATE_CHALLENGE_RESPONSE_SENT)
             {
                 // echo ID could change in this state when our ID is already used.
                 // in this case switch to Server determined ID
                 nextEchoId = id;
                 syslog(LOG_DEBUG, "challenge received");
+
+                // the server did not take our ticket
+                ticket.clear();
+
                 sendChallengeResponse(dataLength);
                 return true;
             }
             break;
         case TunnelHeader::TYPE_CONNECTION_ACCEPT:
-            if (state == STATE_CHALLENGE_RESPONSE_SENT)
+            // without a challenge when the server accepted our ticket or proof
+            if (state == STATE_CHALLENGE_RESPONSE_SENT || state == STATE_CONNECTION_REQUEST_SENT)
             {
-                if (dataLength != sizeof(uint32_t))
+                int acceptLength = sizeof(uint32_t) + TicketIssuer::SIZE + sizeof(uint16_t);
+                if (dataLength != sizeof(uint32_t) && dataLength != sizeof(uint32_t) + TicketIssuer::SIZE &&
+                    dataLength != acceptLength && dataLength != acceptLength + sizeof(uint8_t))
                 {
                     throw Exception("invalid ip received");
                     return true;
@@ -158,6 +423,28 @@ bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
 
                 syslog(LOG_INFO, "connection established");
 
+                nextEchoId = id;
+                ticket.clear();
+                if (dataLength >= sizeof(uint32_t) + TicketIssuer::SIZE)
+                    ticket.assign(echoReceivePayloadBuffer() + sizeof(uint32_t),
+                                  echoReceivePayloadBuffer() + sizeof(uint32_t) + TicketIssuer::SIZE);
+
+                // polling is the only way back from the server, without it udp is not tried
+                uint16_t udpPort = 0;
+                if (dataLength >= acceptLength)
+                    udpPort = ntohs(*(uint16_t *)(echoReceivePayloadBuffer() + sizeof(uint32_t) + TicketIssuer::SIZE));
+                if (udpPort != 0 && maxPolls != 0)
+                {
+                    serverUdpPort = udpPort;
+                    if (!echo->isUdpOpen())
+                        echo->openUdp(0);
+                    nextUdpProbe = now;
+                }
+
+                // servers that know the compact framing say so, we switch right away
+                session.compactHeader = dataLength > acceptLength &&
+                                        (uint8_t)echoReceivePayloadBuffer()[acceptLength] == CompactHeader::VERSION;
+
                 uint32_t ip = ntohl(*(uint32_t *)echoReceivePayloadBuffer());
                 if (ip != clientIp)
                 {
@@ -173,6 +460,10 @@ bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
                 dropPrivileges();
                 startPolling();
 
+                echoIdProbes = 0;
+                if (!echoIds.empty())
+                    sendEchoIdProbes();
+
                 return true;
             }
             break;
@@ -189,6 +480,70 @@ bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
                 return true;
             }
             break;
+        case TunnelHeader::TYPE_FEC_DATA:
+        case TunnelHeader::TYPE_FEC_PARITY:
+            if (state == STATE_ESTABLISHED)
+            {
+                handleFecData(fecDecoder, header.type, dataLength);
+
+                if (maxPolls != 0)
+                    sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_ARQ_DATA:
+        case TunnelHeader::TYPE_ARQ_ACK:
+        case TunnelHeader::TYPE_ARQ_STREAM:
+            if (state == STATE_ESTABLISHED && arqEnabled)
+            {
+                int length = arq.decode(echoReceivePayloadBuffer(), dataLength,
+                                        header.type != TunnelHeader::TYPE_ARQ_ACK, now);
+                if (length > 0 && header.type == TunnelHeader::TYPE_ARQ_STREAM)
+                {
+                    if (relaying)
+                        relay.receiveFrame(echoReceivePayloadBuffer(), length);
+                }
+                else if (length > 0)
+                {
+                    deliverData(length);
+                }
+
+                // the replacement poll carries the ack
+                if (maxPolls != 0)
+                    sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+
+                serveArq();
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_PROBE:
+            if (state == STATE_ESTABLISHED)
+            {
+                scheduler.probeAnswered(seq, now);
+
+                if (find(echoIds.begin(), echoIds.end(), id) != echoIds.end() &&
+                    find(confirmedEchoIds.begin(), confirmedEchoIds.end(), id) == confirmedEchoIds.end())
+                {
+                    confirmedEchoIds.push_back(id);
+                }
+
+                if (route.udpPort != 0 && !udpActive)
+                {
+                    syslog(LOG_INFO, "udp works, switching to it");
+                    udpActive = true;
+                }
+                return true;
+            }
+            break;
+        case TunnelHeader::TYPE_POLL:
+            if (state == STATE_ESTABLISHED)
+            {
+                // the server gave back an aging poll, replace it
+                if (maxPolls != 0)
+                    sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+                return true;
+            }
+            break;
     }
 
     syslog(LOG_DEBUG, "invalid packet type: %d, state: %d", header.type, state);
@@ -198,32 +553,198 @@ bool Client::handleEchoData(char *data, int dataLength, uint32_t realIp,
 
 void Client::sendEchoToServer(int type, int dataLength)
 {
+    // with arq every poll acknowledges what has been received
+    if (type == TunnelHeader::TYPE_POLL && arqEnabled && state == STATE_ESTABLISHED)
+    {
+        type = TunnelHeader::TYPE_ARQ_ACK;
+        dataLength = arq.encodeAck(echoSendPayloadBuffer());
+    }
+
     if (maxPolls == 0 && state == STATE_ESTABLISHED)
-        setTimeout(KEEP_ALIVE_INTERVAL);
+    {
+        nextPoll = now + KEEP_ALIVE_INTERVAL;
+        updateTimeout();
+    }
+
+    if (state == STATE_ESTABLISHED && session.sendCounter == MAX_PACKET_COUNTER)
+    {
+        syslog(LOG_INFO, "packet counter exhausted, reconnecting");
+        sendConnectionRequest();
+        return;
+    }
+
+    // our tunnel mtu leaves no room for the udp header, the biggest echoes go over icmp
+    bool udp = udpActive && dataLength + Echo::udpHeaderSize() - Echo::headerSize() <= payloadBufferSize();
+
+    int path = state == STATE_ESTABLISHED ? scheduler.next(now) : handshakePath;
+    bool sent = sendEchoOverPath(path, type, dataLength, udp);
 
-    nonce += 1;
-    sendEcho(magic, type, dataLength, serverIp, false, nextEchoId, nextEchoSequence, nonce, key);
+    // a path whose interface went away fails right at the socket, there is
+    // no need to wait for its probes to tell
+    if (!sent && state == STATE_ESTABLISHED)
+        scheduler.pollLost(path);
+
+    if (sent && maxPolls != 0 && state == STATE_ESTABLISHED)
+    {
+        // the server only keeps the latest maxPolls echo requests
+        if (pendingPolls.size() == maxPolls)
+        {
+            pendingPolls.pop_front();
+            pollStatistics.evicted++;
+        }
+
+        pendingPolls.push_back(PendingPoll(nextEchoSequence, now, path));
+        pollStatistics.sent++;
+    }
 
-    lastSequence = nextEchoSequence;
-    
-    //if (changeEchoId)
-    //    nextEchoId = nextEchoId + 38543; // some random prime
     if (changeEchoSeq)
         nextEchoSequence = nextEchoSequence + 1; // use +1 to simulte linux
 }
 
 void Client::startPolling()
 {
+    fecEncoder.setGroupSize(fecGroupSize, fecAutomatic);
+    fecDecoder = Fec::Decoder();
+    reorderBuffer = ReorderBuffer();
+    arq = Arq();
+
+    headerEncoder = HeaderCompression::Encoder();
+    serverHeaders = HeaderCompression::Decoder();
+    headerDecoder = headerCompression ? &serverHeaders : NULL;
+
+    // the arq state the streams relied on is gone
+    relay.closeAll();
+
     if (maxPolls == 0)
     {
-        setTimeout(KEEP_ALIVE_INTERVAL);
+        nextPoll = now + KEEP_ALIVE_INTERVAL;
     }
     else
     {
         for (int i = 0; i < maxPolls; i++)
             sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
-        setTimeout(POLL_INTERVAL);
+        nextPoll = now + POLL_INTERVAL;
+    }
+
+    // how soon a silent server is given up depends on the rtt of its paths
+    if (servers.size() > 1)
+        for (int i = 0; i < scheduler.size(); i++)
+            sendProbe(i);
+
+    updateTimeout();
+}
+
+void Client::pollAnswered(uint16_t seq)
+{
+    if (maxPolls == 0)
+        return;
+
+    deque<PendingPoll>::iterator poll;
+    for (poll = pendingPolls.begin(); poll != pendingPolls.end(); ++poll)
+        if (poll->seq == seq)
+            break;
+
+    if (poll == pendingPolls.end())
+    {
+        pollStatistics.late++;
+        return;
     }
+
+    rtt.addSample(now - poll->sent, now);
+    scheduler.pollAnswered(poll->path);
+    pollStatistics.answered++;
+    pacer.packetsDelivered(1, now);
+
+    // the server answers polls in the order they arrived, so older ones still
+    // pending on the same path have been lost unless their replies are just reordered
+    int reorderWindow = rtt.minRtt().milliseconds() / 4;
+    if (reorderWindow < MIN_REORDER_WINDOW)
+        reorderWindow = MIN_REORDER_WINDOW;
+
+    for (deque<PendingPoll>::iterator older = pendingPolls.begin(); older != poll; ++older)
+        if (older->path == poll->path && older->lossDeadline == Time::ZERO)
+            older->lossDeadline = now + reorderWindow;
+
+    pendingPolls.erase(poll);
+
+    updateTimeout();
+}
+
+void Client::detectLostPolls()
+{
+    int lost = 0;
+
+    // the server answers polls before POLL_TIMEOUT, so one which is still
+    // pending a timeout later has been lost
+    Time lifetime = Time(POLL_TIMEOUT) + rtt.rto();
+
+    deque<PendingPoll>::iterator poll = pendingPolls.begin();
+    while (poll != pendingPolls.end())
+    {
+        if ((poll->lossDeadline != Time::ZERO && !(now < poll->lossDeadline)) ||
+            !(now < poll->sent + lifetime))
+        {
+            scheduler.pollLost(poll->path);
+            poll = pendingPolls.erase(poll);
+            lost++;
+        }
+        else
+            ++poll;
+    }
+
+    if (lost == 0)
+        return;
+
+    syslog(LOG_DEBUG, "%d polls lost, replacing them", lost);
+    pollStatistics.lost += lost;
+
+    // nothing came back over udp for longer than the server holds a poll
+    if (udpActive && !(now < lastUdpReceived + UDP_FALLBACK_TIMEOUT))
+    {
+        syslog(LOG_INFO, "udp stopped working, falling back to icmp");
+        udpActive = false;
+        nextUdpProbe = now + UDP_PROBE_INTERVAL;
+    }
+    pacer.packetsLost(lost, now);
+    fecEncoder.lossDetected(now);
+
+    for (int i = 0; i < lost; i++)
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+}
+
+void Client::updateTimeout()
+{
+    Time deadline = nextPoll;
+
+    if (pendingPolls.size() > 0 && pendingPolls.front().sent + POLL_TIMEOUT + rtt.rto() < deadline)
+        deadline = pendingPolls.front().sent + POLL_TIMEOUT + rtt.rto();
+
+    for (deque<PendingPoll>::iterator poll = pendingPolls.begin(); poll != pendingPolls.end(); ++poll)
+        if (poll->lossDeadline != Time::ZERO && poll->lossDeadline < deadline)
+            deadline = poll->lossDeadline;
+
+    if (fecEncoder.groupPending() && fecEncoder.flushDeadline() < deadline)
+        deadline = fecEncoder.flushDeadline();
+
+    if (!reorderBuffer.isEmpty() && reorderBuffer.deadline() < deadline)
+        deadline = reorderBuffer.deadline();
+
+    if (arqEnabled && arq.deadline() != Time::ZERO && arq.deadline() < deadline)
+        deadline = arq.deadline();
+
+    if (serverUdpPort != 0 && !udpActive && nextUdpProbe < deadline)
+        deadline = nextUdpProbe;
+
+    if (nextEchoIdProbe != Time::ZERO && nextEchoIdProbe < deadline)
+        deadline = nextEchoIdProbe;
+
+    if (scheduler.size() > 1 && scheduler.probeDeadline() < deadline)
+        deadline = scheduler.probeDeadline();
+
+    if (servers.size() > 1 && silenceDeadline() < deadline)
+        deadline = silenceDeadline();
+
+    setTimeout(deadline < now ? Time::ZERO : deadline - now);
 }
 
 void Client::handleDataFromServer(int dataLength)
@@ -234,38 +755,346 @@ void Client::handleDataFromServer(int dataLength)
         return;
     }
 
-    sendToTun(dataLength);
+    deliverData(dataLength);
 
     if (maxPolls != 0)
         sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
 }
 
+void Client::deliverData(int length)
+{
+    if (reorderHoldPercent == 0)
+    {
+        sendToTun(length);
+        return;
+    }
+
+    // the reorder buffer writes to the tunnel itself
+    length = decodeHeaders(length);
+    if (length == 0)
+        return;
+
+    reorderBuffer.insert(receivedCounter(), echoReceivePayloadBuffer(), length, now);
+    releaseReordered();
+}
+
+void Client::releaseReordered()
+{
+    // polls wait on the server, so their smoothed rtt can grow to seconds. the
+    // probes of several paths are answered right away, a single path only has
+    // the minimum of the polls, which is not inflated.
+    Time reference = scheduler.srtt();
+    if (reference == Time::ZERO)
+        reference = rtt.minRtt();
+
+    reorderBuffer.setHoldTime(reference.milliseconds() * reorderHoldPercent / 100);
+
+    vector<char> packet;
+    while (reorderBuffer.release(packet, now))
+        tun->write(&packet[0], packet.size());
+
+    updateTimeout();
+}
+
 void Client::handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp)
 {
     if (state != STATE_ESTABLISHED)
         return;
 
+    if (!AckThinner::thinnable(echoSendPayloadBuffer(), dataLength))
+    {
+        sendTunData(dataLength);
+        return;
+    }
+
+    // acks waiting behind this one in the tunnel device may make it redundant
+    ackThinner.hold(echoSendPayloadBuffer(), dataLength);
+
+    for (int i = 1; i < ACK_THINNING_BURST && tun->hasData(); i++)
+    {
+        int length = tun->read(echoSendPayloadBuffer());
+        if (length <= 0)
+            break;
+
+        if (!AckThinner::thinnable(echoSendPayloadBuffer(), length))
+        {
+            // after the acks read before it
+            vector<char> packet(echoSendPayloadBuffer(), echoSendPayloadBuffer() + length);
+            sendHeldAcks();
+            memcpy(echoSendPayloadBuffer(), &packet[0], length);
+            sendTunData(length);
+            return;
+        }
+
+        ackThinner.hold(echoSendPayloadBuffer(), length);
+    }
+
+    sendHeldAcks();
+}
+
+void Client::sendHeldAcks()
+{
+    vector<char> packet;
+    while (ackThinner.release(packet))
+    {
+        memcpy(echoSendPayloadBuffer(), &packet[0], packet.size());
+        sendTunData(packet.size());
+    }
+}
+
+void Client::sendTunData(int dataLength)
+{
+    if (state != STATE_ESTABLISHED)
+        return;
+
+    clampMss(echoSendPayloadBuffer(), dataLength, tunnelMtu);
+
+    if (headerCompression)
+        dataLength = headerEncoder.encode(echoSendPayloadBuffer(), dataLength);
+
+    if (arqEnabled)
+    {
+        dataLength = arq.encodeData(echoSendPayloadBuffer(), dataLength, TunnelHeader::TYPE_ARQ_DATA, now);
+        if (dataLength == 0)
+        {
+            DEBUG_ONLY(printf("arq window full, packet dropped\n"));
+            return;
+        }
+
+        sendEchoToServer(TunnelHeader::TYPE_ARQ_DATA, dataLength);
+        updateTimeout();
+        return;
+    }
+
+    if (fecEncoder.isActive(now))
+    {
+        dataLength = fecEncoder.encode(echoSendPayloadBuffer(), dataLength, now);
+        sendEchoToServer(TunnelHeader::TYPE_FEC_DATA, dataLength);
+
+        if (fecEncoder.groupComplete())
+            sendFecParity();
+        else
+            updateTimeout();
+        return;
+    }
+
     sendEchoToServer(TunnelHeader::TYPE_DATA, dataLength);
 }
 
+void Client::serveArq()
+{
+    int length, type;
+    while ((length = arq.retransmit(echoSendPayloadBuffer(), type, now)) > 0)
+        sendEchoToServer(type, length);
+
+    if (arq.ackDue(now))
+        sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+
+    updateTimeout();
+}
+
+void Client::addStreamFds(fd_set &readFds, fd_set &writeFds, int &maxFd)
+{
+    if (relaying)
+        relay.addFds(readFds, writeFds, maxFd);
+}
+
+void Client::handleStreams(const fd_set &readFds, const fd_set &writeFds)
+{
+    if (!relaying)
+        return;
+
+    relay.handleFds(readFds, writeFds);
+
+    if (state != STATE_ESTABLISHED)
+        return;
+
+    // only what arq can take is read from the connections
+    int length;
+    while (arq.canSend() && (length = relay.nextFrame(echoSendPayloadBuffer(), tunnelMtu)) > 0)
+    {
+        length = arq.encodeData(echoSendPayloadBuffer(), length, TunnelHeader::TYPE_ARQ_STREAM, now);
+        sendEchoToServer(TunnelHeader::TYPE_ARQ_STREAM, length);
+    }
+
+    updateTimeout();
+}
+
+bool Client::sendEchoOverPath(int path, int type, int dataLength, bool udp)
+{
+    // paths are all combinations of local sockets and server addresses
+    Echo::Route route;
+    route.udpPort = udp ? serverUdpPort : 0;
+    route.socket = path / serverIps.size();
+
+    // the server learns the other ids with the connection request
+    uint16_t id = nextEchoId;
+    if (state == STATE_ESTABLISHED && !confirmedEchoIds.empty())
+    {
+        echoIdIndex = (echoIdIndex + 1) % (confirmedEchoIds.size() + 1);
+        if (echoIdIndex != 0)
+            id = confirmedEchoIds[echoIdIndex - 1];
+    }
+
+    return sendEcho(magic, type, dataLength, serverIps[path % serverIps.size()], false,
+                    id, nextEchoSequence, route, session);
+}
+
+void Client::sendProbe(int path)
+{
+    // the server echoes it back right away, it does not take the place of a poll
+    sendEchoOverPath(path, TunnelHeader::TYPE_PROBE, 0, udpActive);
+    scheduler.probeSent(path, nextEchoSequence++, now);
+}
+
+void Client::sendUdpProbe()
+{
+    syslog(LOG_DEBUG, "probing udp");
+
+    sendEchoOverPath(handshakePath, TunnelHeader::TYPE_PROBE, 0, true);
+    nextEchoSequence++;
+
+    nextUdpProbe = now + UDP_PROBE_INTERVAL;
+}
+
+void Client::sendEchoIdProbes()
+{
+    // over icmp, where a nat would rewrite the ids
+    Echo::Route route;
+    route.socket = handshakePath / serverIps.size();
+
+    if (confirmedEchoIds.size() == echoIds.size() || echoIdProbes == ECHO_ID_PROBES)
+    {
+        syslog(LOG_INFO, "%d of %d echo ids got through", (int)confirmedEchoIds.size() + 1,
+               (int)echoIds.size() + 1);
+        nextEchoIdProbe = Time::ZERO;
+        return;
+    }
+
+    for (int i = 0; i < echoIds.size(); i++)
+        if (find(confirmedEchoIds.begin(), confirmedEchoIds.end(), echoIds[i]) == confirmedEchoIds.end())
+            sendEcho(magic, TunnelHeader::TYPE_PROBE, 0, serverIps[handshakePath % serverIps.size()], false,
+                     echoIds[i], nextEchoSequence++, route, session);
+
+    echoIdProbes++;
+    nextEchoIdProbe = now + ECHO_ID_PROBE_INTERVAL;
+}
+
+void Client::sendFecParity()
+{
+    int length = fecEncoder.writeParity(echoSendPayloadBuffer());
+    sendEchoToServer(TunnelHeader::TYPE_FEC_PARITY, length);
+}
+
 void Client::handleTimeout()
 {
     switch (state)
     {
+        case STATE_SERVERS_PROBED:
         case STATE_CONNECTION_REQUEST_SENT:
         case STATE_CHALLENGE_RESPONSE_SENT:
             sendConnectionRequest();
             break;
 
         case STATE_ESTABLISHED:
-            sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
-            setTimeout(maxPolls == 0 ? KEEP_ALIVE_INTERVAL : POLL_INTERVAL);
+            if (servers.size() > 1 && serverSilent())
+                break;
+
+            detectLostPolls();
+
+            // send the parity of an incomplete group when traffic pauses
+            if (fecEncoder.groupPending() && !(now < fecEncoder.flushDeadline()))
+                sendFecParity();
+
+            if (!reorderBuffer.isEmpty())
+                releaseReordered();
+
+            if (arqEnabled)
+                serveArq();
+
+            if (serverUdpPort != 0 && !udpActive && !(now < nextUdpProbe))
+                sendUdpProbe();
+
+            if (nextEchoIdProbe != Time::ZERO && !(now < nextEchoIdProbe))
+                sendEchoIdProbes();
+
+            int path;
+            while ((path = scheduler.probeDue(now)) != -1)
+                sendProbe(path);
+
+            if (!(now < nextPoll))
+            {
+                // send at least one poll to refresh the oldest one on the server
+                int polls = maxPolls - (int)pendingPolls.size();
+                if (polls < 1)
+                    polls = 1;
+
+                for (int i = 0; i < polls; i++)
+                    sendEchoToServer(TunnelHeader::TYPE_POLL, 0);
+
+                nextPoll = now + (maxPolls == 0 ? KEEP_ALIVE_INTERVAL : POLL_INTERVAL);
+            }
+
+            updateTimeout();
             break;
         case STATE_CLOSED:
             break;
     }
 }
 
+void Client::logStatistics()
+{
+    Worker::logStatistics();
+
+    syslog(LOG_INFO, "polls: %u sent, %u answered, %u lost, %u late, %u evicted, %u pending",
+           pollStatistics.sent, pollStatistics.answered, pollStatistics.lost,
+           pollStatistics.late, pollStatistics.evicted, (unsigned int)pendingPolls.size());
+
+    if (serverUdpPort != 0)
+        syslog(LOG_INFO, "transport: %s", udpActive ? "udp" : "icmp");
+
+    if (rtt.hasSamples())
+        syslog(LOG_INFO, "rtt: %d ms smoothed, %d ms minimum, %d ms timeout",
+               rtt.srtt().milliseconds(), rtt.minRtt().milliseconds(), rtt.rto().milliseconds());
+
+    if (scheduler.size() > 1)
+        for (int i = 0; i < scheduler.size(); i++)
+            syslog(LOG_INFO, "path %s%s%s: %u echoes sent, %d ms rtt, %d.%d%% lost",
+                   Utility::formatIp(serverIps[i % serverIps.size()]).c_str(),
+                   echo->socketCount() > 1 ? " via " : "",
+                   echo->socketCount() > 1 ? echo->getInterface(i / serverIps.size()).c_str() : "",
+                   scheduler.getSent(i),
+                   scheduler.getRtt(i).srtt().milliseconds(),
+                   scheduler.getLoss(i) / 10, scheduler.getLoss(i) % 10);
+
+    if (fecEncoder.getParitySent() != 0 || fecDecoder.getRecovered() != 0)
+        syslog(LOG_INFO, "fec: %u parity frames sent, %u packets recovered",
+               fecEncoder.getParitySent(), fecDecoder.getRecovered());
+
+    if (arqEnabled)
+        syslog(LOG_INFO, "arq: %d frames in flight, %u retransmitted, %u duplicates, %u window full",
+               arq.getInFlight(), arq.getRetransmitted(), arq.getDuplicates(), arq.getWindowFull());
+
+    if (reorderHoldPercent != 0)
+        syslog(LOG_INFO, "reordering: %u packets out of order, %u gaps skipped, %u packets held",
+               reorderBuffer.getReordered(), reorderBuffer.getGapsSkipped(),
+               (unsigned int)reorderBuffer.size());
+
+    if (relaying)
+        syslog(LOG_INFO, "relay: %d connections, %u opened, %u reset, %llu kB sent, %llu kB received",
+               relay.getStreams(), relay.getOpened(), relay.getReset(),
+               (unsigned long long)(relay.getBytesSent() / 1000),
+               (unsigned long long)(relay.getBytesReceived() / 1000));
+
+    if (ackThinner.getThinned() != 0)
+        syslog(LOG_INFO, "acks: %u thinned", ackThinner.getThinned());
+
+    if (headerCompression)
+        syslog(LOG_INFO, "headers: %u compressed, %u sent in full, %u bytes saved, %u dropped",
+               headerEncoder.getCompressed(), headerEncoder.getFull(), headerEncoder.getSaved(),
+               serverHeaders.getDropped());
+}
+
 void Client::run()
 {
     now = Time::now();
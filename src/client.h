@@ -22,62 +22,179 @@
 
 #include "worker.h"
 #include "auth.h"
+#include "rtt.h"
+#include "reorder.h"
+#include "scheduler.h"
+#include "acks.h"
+#include "relay.h"
+#include "routes.h"
 
 #include <vector>
+#include <deque>
+#include <string>
 
 class Client : public Worker
 {
 public:
-    Client(int tunnelMtu, const char *deviceName, uint32_t serverIp,
+    Client(int tunnelMtu, const char *deviceName, const std::vector<std::vector<uint32_t> > &servers,
            int maxPolls, const char *passphrase, uid_t uid, gid_t gid,
            bool changeEchoId, bool changeEchoSeq, uint32_t desiredIp);
     virtual ~Client();
 
     virtual void run();
 
+    void setReordering(int holdPercent) { reorderHoldPercent = holdPercent; }
+    void setArq(bool enabled) { arqEnabled = enabled; }
+    void setCompression(bool enabled) { compression = enabled; }
+    void setHeaderCompression(bool enabled) { headerCompression = enabled; }
+    void setRelay(uint16_t port) { relay.listen(port); relaying = true; }
+    void setInterfaces(const std::vector<std::string> &interfaces);
+    void setRoutes(const std::vector<RouteTable::Prefix> &routes) { this->routes = routes; }
+
     static const Worker::TunnelHeader::Magic magic;
 protected:
     enum State
     {
         STATE_CLOSED,
+        STATE_SERVERS_PROBED,
         STATE_CONNECTION_REQUEST_SENT,
         STATE_CHALLENGE_RESPONSE_SENT,
         STATE_ESTABLISHED
     };
 
-    virtual bool handleEchoData(char *data, int dataLength,
-                                uint32_t realIp, bool reply, uint16_t id,
-                                uint16_t seq,  uint64_t &nonce, unsigned char *key);
+    // echo request which has not been answered by the server yet
+    struct PendingPoll
+    {
+        PendingPoll(uint16_t _seq, Time _sent, int _path) : seq(_seq), sent(_sent), path(_path) { }
+
+        uint16_t seq;
+        Time sent;
+        int path;
+        Time lossDeadline; // set once a later poll has been answered
+    };
+
+    struct PollStatistics
+    {
+        PollStatistics() : sent(0), answered(0), lost(0), late(0), evicted(0) { }
+
+        unsigned int sent;
+        unsigned int answered;
+        unsigned int lost;
+        unsigned int late;     // answered after being declared lost
+        unsigned int evicted;  // dropped by the server to make room for a newer one
+    };
+
+    virtual bool handleEchoData(int dataLength, uint32_t realIp, bool reply,
+                                uint16_t id, uint16_t seq, const Echo::Route &route);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
     virtual void handleTimeout();
+    virtual void logStatistics();
+    virtual void deliverData(int length);
+    virtual void addStreamFds(fd_set &readFds, fd_set &writeFds, int &maxFd);
+    virtual void handleStreams(const fd_set &readFds, const fd_set &writeFds);
 
     void handleDataFromServer(int length);
+    void sendTunData(int dataLength);
+    void sendHeldAcks();
+    void releaseReordered();
+    void serveArq();
+    void sendFecParity();
+    bool sendEchoOverPath(int path, int type, int dataLength, bool udp);
+    void sendProbe(int path);
+    void sendUdpProbe();
+    void sendEchoIdProbes();
 
     void startPolling();
+    void pollAnswered(uint16_t seq);
+    void detectLostPolls();
+    void updateTimeout();
 
     void sendEchoToServer(int type, int dataLength);
+    void startSession();
+    int writeConnectData(const Auth::Challenge *challenge, bool prove);
     void sendChallengeResponse(int dataLength);
     void sendConnectionRequest();
+    void probeServers();
+    int findServer(uint32_t ip);
+    void useServer(int server);
+    Time silenceDeadline();
+    bool serverSilent();
 
     Auth auth;
 
-    uint32_t serverIp;
+    // servers to choose from, each with all of its addresses
+    std::vector<std::vector<uint32_t> > servers;
+    std::vector<Session> serverSessions; // of the requests probing them
+    int currentServer;
+
+    // addresses of the current server, echoes are spread over all of them
+    // and every local socket
+    std::vector<uint32_t> serverIps;
+    PathScheduler scheduler;
+    int handshakePath; // tried in turn until one gets through
     uint32_t clientIp;
     uint32_t desiredIp;
 
     int maxPolls;
     int pollTimeoutNr;
 
+    std::deque<PendingPoll> pendingPolls;
+    PollStatistics pollStatistics;
+    RttEstimator rtt;
+    Time nextPoll;
+
+    Time lastReceived;
+    int silenceProbes; // sent since the server fell silent
+    Time lastSilenceProbe;
+
+    Fec::Encoder fecEncoder;
+    Fec::Decoder fecDecoder;
+
+    // hold time of the reorder buffer in percent of the smoothed rtt, 0 disables it
+    int reorderHoldPercent;
+    ReorderBuffer reorderBuffer;
+
+    bool arqEnabled;
+    Arq arq;
+
+    bool compression;
+
+    bool headerCompression;
+    HeaderCompression::Encoder headerEncoder;
+    HeaderCompression::Decoder serverHeaders; // decodes what the server compressed
+
+    AckThinner ackThinner;
+
+    // tcp connections redirected to the client are relayed to the server
+    bool relaying;
+    StreamRelay relay;
+
+    // udp port offered by the server, 0 if it only speaks icmp
+    uint16_t serverUdpPort;
+    bool udpActive;
+    Time nextUdpProbe;
+    Time lastUdpReceived;
+
     bool changeEchoId, changeEchoSeq;
 
     uint16_t nextEchoId;
     uint16_t nextEchoSequence;
 
-    uint64_t nonce; // we use 8byte nounce
-    unsigned char key[crypto_stream_salsa20_KEYBYTES];
+    // registered with the server, those it answered on take turns with
+    // nextEchoId once connected
+    std::vector<uint16_t> echoIds;
+    std::vector<uint16_t> confirmedEchoIds;
+    int echoIdIndex;
+    int echoIdProbes; // rounds sent for the unconfirmed ids
+    Time nextEchoIdProbe; // 0 when done
+
+    Session session;
     State state;
-private:
-    uint16_t lastSequence;
+
+    std::vector<char> ticket; // resumption ticket of the last connection
+    bool offerVersion2; // until a server rejects the request
+
+    std::vector<RouteTable::Prefix> routes; // networks the server routes to us
 };
 
 #endif
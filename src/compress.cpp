@@ -0,0 +1,135 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "compress.h"
+#include "exception.h"
+#include "config.h"
+
+#include <string.h>
+
+Compressor::Compressor()
+{
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+
+    // raw streams, a packet is too short to spend bytes on a zlib header
+    if (deflateInit2(&deflater, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Exception("initializing compression");
+    if (inflateInit2(&inflater, -15) != Z_OK)
+        throw Exception("initializing decompression");
+
+    compressed = 0;
+    skipped = 0;
+    incompressible = 0;
+    bytesIn = 0;
+    bytesOut = 0;
+    cpuTime = 0;
+}
+
+Compressor::~Compressor()
+{
+    deflateEnd(&deflater);
+    inflateEnd(&inflater);
+}
+
+bool Compressor::compressible(const char *data, int length)
+{
+    // random bytes use most of the byte values in a sample, text and
+    // protocol headers only a few. the end of a packet is past its headers.
+    int sampleSize = length < COMPRESS_SAMPLE_SIZE ? length : COMPRESS_SAMPLE_SIZE;
+    const unsigned char *sample = (const unsigned char *)data + length - sampleSize;
+
+    bool seen[256];
+    memset(seen, 0, sizeof(seen));
+
+    int distinct = 0;
+    for (int i = 0; i < sampleSize; i++)
+    {
+        if (!seen[sample[i]])
+        {
+            seen[sample[i]] = true;
+            distinct++;
+        }
+    }
+
+    return distinct * 100 < sampleSize * COMPRESS_MAX_DISTINCT;
+}
+
+int Compressor::compress(char *data, int length)
+{
+    if (length < COMPRESS_MIN_LENGTH)
+        return 0;
+
+    if (!compressible(data, length))
+    {
+        skipped++;
+        return 0;
+    }
+
+    clock_t start = clock();
+
+    if (buffer.size() < length)
+        buffer.resize(length);
+
+    deflateReset(&deflater);
+    deflater.next_in = (Bytef *)data;
+    deflater.avail_in = length;
+    deflater.next_out = (Bytef *)&buffer[0];
+    deflater.avail_out = length - 1;
+
+    // the output buffer is too small for anything that does not shrink
+    int result = deflate(&deflater, Z_FINISH);
+    int compressedLength = length - 1 - deflater.avail_out;
+
+    cpuTime += clock() - start;
+
+    if (result != Z_STREAM_END)
+    {
+        incompressible++;
+        return 0;
+    }
+
+    memcpy(data, &buffer[0], compressedLength);
+
+    compressed++;
+    bytesIn += length;
+    bytesOut += compressedLength;
+
+    return compressedLength;
+}
+
+int Compressor::decompress(char *data, int length, int maxLength)
+{
+    if (buffer.size() < maxLength)
+        buffer.resize(maxLength);
+
+    inflateReset(&inflater);
+    inflater.next_in = (Bytef *)data;
+    inflater.avail_in = length;
+    inflater.next_out = (Bytef *)&buffer[0];
+    inflater.avail_out = maxLength;
+
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END)
+        return -1;
+
+    int decompressedLength = maxLength - inflater.avail_out;
+    memcpy(data, &buffer[0], decompressedLength);
+
+    return decompressedLength;
+}
@@ -0,0 +1,62 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+// deflates packets one by one, echoes get lost and reordered so nothing is
+// shared between them. data that is already compressed or encrypted is
+// recognized from a sample and sent as it is.
+class Compressor
+{
+public:
+    Compressor();
+    ~Compressor();
+
+    int compress(char *data, int length); // in place, 0 if it would not get smaller
+    int decompress(char *data, int length, int maxLength); // in place, -1 if invalid
+
+    unsigned int getCompressed() const { return compressed; }
+    unsigned int getSkipped() const { return skipped; }
+    unsigned int getIncompressible() const { return incompressible; }
+    uint64_t getBytesIn() const { return bytesIn; }
+    uint64_t getBytesOut() const { return bytesOut; }
+    int getCpuTime() const { return cpuTime * 1000 / CLOCKS_PER_SEC; } // in ms
+
+protected:
+    bool compressible(const char *data, int length);
+
+    z_stream deflater;
+    z_stream inflater;
+    std::vector<char> buffer;
+
+    unsigned int compressed;
+    unsigned int skipped;        // by the sample
+    unsigned int incompressible; // tried but not smaller
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    clock_t cpuTime;
+};
+
+#endif
@@ -22,7 +22,100 @@
 #define KEEP_ALIVE_INTERVAL (60 * 1000)
 #define POLL_INTERVAL 2000
 
+// polls are answered empty on the server before their nat state expires
+#define POLL_TIMEOUT 5000
+#define POLL_EXPIRY_MARGIN 500
+
+#define RTO_INITIAL 1000
+#define RTO_MIN 200
+#define RTO_MAX 60000
+#define RTT_MIN_WINDOW 10000
+
+// a poll overtaken by the reply to a later one is lost after min_rtt / 4
+#define MIN_REORDER_WINDOW 2
+
 #define CHALLENGE_SIZE 20
+#define TICKET_LIFETIME (24 * 60 * 60) // seconds
+#define PROOF_MAX_CLOCK_SKEW 120 // seconds
+#define COOKIE_LIFETIME 60 // seconds, at most PROOF_MAX_CLOCK_SKEW
+
+// a connection is restarted before its packet counter and so a nonce repeats
+#define MAX_PACKET_COUNTER 0xffffffffu
+
+#define MAX_PACED_ECHOES 100
+#define PACING_INITIAL_RATE 1000
+#define PACING_MIN_RATE 10
+#define PACING_MAX_RATE 100000
+#define PACING_MIN_BURST 4
+#define PACING_INTERVAL 1000
+
+#define FEC_MAX_GROUP_SIZE 32
+#define FEC_MAX_GROUPS 8
+#define FEC_FLUSH_DELAY 20
+#define FEC_AUTO_DURATION 30000
+
+#define REORDER_MAX_PACKETS 64
+
+#define ARQ_WINDOW 256
+#define ARQ_ACK_FRAMES 2
+#define ARQ_ACK_DELAY 10
+
+// udp is tried in the background and given up when polls get lost while
+// nothing has come back over it for longer than the server holds a poll
+#define UDP_PROBE_INTERVAL 30000
+#define UDP_FALLBACK_TIMEOUT POLL_TIMEOUT
+
+// share of echoes a path gets at least, and the gain of its loss average.
+// rtts below PATH_MIN_RTT are not told apart.
+#define PATH_MIN_SHARE 10 // per mille
+#define PATH_LOSS_GAIN 16
+#define PATH_MIN_RTT 10
+#define PATH_PROBE_INTERVAL 1000
+#define MULTIPATH_REORDER_PERCENT 50
+
+// firewalls often police icmp per echo id, with -i a client spreads its
+// echoes over this many ids. the server takes at most MAX_ECHO_IDS.
+#define ECHO_ID_POOL_SIZE 8
+#define MAX_ECHO_IDS 32
+
+// a nat may rewrite the ids, each one is probed up to this many times and
+// only used once the server answered on it
+#define ECHO_ID_PROBES 3
+#define ECHO_ID_PROBE_INTERVAL 1000
+
+// prefixes a client may have routed to it
+#define MAX_CLIENT_ROUTES 64
+
+// the sockets of the server carry the mark, kernel replies to where they sent
+// echo replies are dropped until that has not happened for the timeout
+#define REPLY_FILTER_MARK 0x68616e73
+#define REPLY_FILTER_TIMEOUT (2 * KEEP_ALIVE_INTERVAL)
+
+// with several servers a silent one is probed every rto and left after
+// this many probes went unanswered
+#define FAILOVER_PROBES 3
+
+// a sample from the end of a packet tells whether it is worth compressing,
+// it is not when more than COMPRESS_MAX_DISTINCT percent of its bytes differ
+#define COMPRESS_MIN_LENGTH 64
+#define COMPRESS_SAMPLE_SIZE 128
+#define COMPRESS_MAX_DISTINCT 60
+#define COMPRESS_LEVEL 1
+
+// header compression contexts per direction. a new context is sent in full
+// HEADER_FULL_REPEAT times and then again every HEADER_REFRESH_PACKETS packets
+#define HEADER_CONTEXTS 16
+#define HEADER_FULL_REPEAT 3
+#define HEADER_REFRESH_PACKETS 64
+
+// pure tcp acks the client reads from the tunnel device at once to pass on
+// only the latest of each flow
+#define ACK_THINNING_BURST 32
+
+// bytes a relayed tcp connection may have on the way in either direction,
+// and connections relayed at once per client
+#define RELAY_WINDOW 262144
+#define RELAY_MAX_STREAMS 256
 
 //#define DEBUG_ONLY(a) a
 #define DEBUG_ONLY(a)
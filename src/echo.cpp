@@ -22,8 +22,10 @@
 #include "utility.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in_systm.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
@@ -32,22 +34,22 @@
 #include <string.h>
 #include <sys/types.h>
 
-#include <nacl/crypto_stream_salsa20.h>
+using namespace std;
 
 Echo::Echo(int maxPayloadSize):
-    isConnectionRequest(false),
     bufferSize(maxPayloadSize + headerSize()),
     sendBuffer(new char[bufferSize]),
     receiveBuffer(new char[bufferSize])
 {
-    fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (fd == -1)
-        throw Exception("creating icmp socket", true);
+    mark = 0;
+    interfaces.push_back("");
+    fds.push_back(openSocket(SOCK_RAW, "", 0));
+    udpFds.push_back(-1);
 }
 
 Echo::~Echo()
 {
-    close(fd);
+    closeSockets();
 
     delete[] sendBuffer;
     delete[] receiveBuffer;
@@ -58,13 +60,112 @@ int Echo::headerSize()
     return sizeof(IpHeader) + sizeof(EchoHeader);
 }
 
-void Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id,
-                uint16_t seq, const uint64_t &nonce, const unsigned char *key)
+int Echo::udpHeaderSize()
 {
-    struct sockaddr_in target;
-    target.sin_family = AF_INET;
-    target.sin_addr.s_addr = htonl(realIp);
+    return sizeof(IpHeader) + sizeof(udphdr) + sizeof(EchoHeader);
+}
+
+int Echo::openSocket(int type, const string &interface, uint16_t port)
+{
+    int fd = type == SOCK_RAW ? socket(AF_INET, SOCK_RAW, IPPROTO_ICMP) :
+                                socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == -1)
+        throw Exception(type == SOCK_RAW ? "creating icmp socket" : "creating udp socket", true);
+
+#ifdef IP_PKTINFO
+    // learn the address echoes were sent to, to answer from it
+    int on = 1;
+    setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+#endif
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    // an interface is given by its address or by its name
+    if (!interface.empty())
+    {
+        in_addr_t localIp = inet_addr(interface.c_str());
+        if (localIp != INADDR_NONE)
+        {
+            address.sin_addr.s_addr = localIp;
+        }
+        else
+        {
+#ifdef SO_BINDTODEVICE
+            if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, interface.c_str(), interface.size() + 1) == -1)
+                throw Exception(("binding to " + interface).c_str(), true);
+#else
+            throw Exception("binding to an interface by name is not supported, use its address");
+#endif
+        }
+    }
+
+    if (address.sin_port != 0 || address.sin_addr.s_addr != htonl(INADDR_ANY))
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+            throw Exception(type == SOCK_RAW ? "binding icmp socket" : "binding udp socket", true);
+
+#ifdef SO_MARK
+    if (mark != 0 && setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1)
+        throw Exception("setting socket mark", true);
+#endif
+
+    return fd;
+}
 
+void Echo::closeSockets()
+{
+    for (int i = 0; i < fds.size(); i++)
+    {
+        close(fds[i]);
+        if (udpFds[i] != -1)
+            close(udpFds[i]);
+    }
+
+    fds.clear();
+    udpFds.clear();
+}
+
+void Echo::bindSockets(const vector<string> &interfaces)
+{
+    closeSockets();
+
+    this->interfaces = interfaces;
+    for (int i = 0; i < interfaces.size(); i++)
+    {
+        fds.push_back(openSocket(SOCK_RAW, interfaces[i], 0));
+        udpFds.push_back(-1);
+    }
+}
+
+void Echo::openUdp(uint16_t port)
+{
+    for (int i = 0; i < interfaces.size(); i++)
+        udpFds[i] = openSocket(SOCK_DGRAM, interfaces[i], port);
+}
+
+void Echo::setMark(uint32_t mark)
+{
+#ifdef SO_MARK
+    this->mark = mark;
+
+    for (int i = 0; i < fds.size(); i++)
+    {
+        if (setsockopt(fds[i], SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1)
+            throw Exception("setting socket mark", true);
+        if (udpFds[i] != -1 && setsockopt(udpFds[i], SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1)
+            throw Exception("setting socket mark", true);
+    }
+#else
+    throw Exception("socket marks are not supported");
+#endif
+}
+
+bool Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                const Route &route)
+{
     int packetlen = payloadLength + sizeof(IpHeader) + sizeof(EchoHeader);
 
     if (packetlen > bufferSize)
@@ -77,37 +178,107 @@ void Echo::send(int payloadLength, uint32_t realIp, bool reply, uint16_t id,
     header->seq = htons(seq);
     header->chksum = 0;
 
-    unsigned char *payloadData = (unsigned char *)sendBuffer;
-    payloadData += sizeof(EchoHeader) + sizeof(IpHeader);
-    if (nonce != -1 && key != NULL) 
-        crypto_stream_salsa20_xor(payloadData, payloadData , payloadLength,
-                              (const unsigned char *)&nonce, key);
-
-    // checksum must be made after encryption
-    header->chksum = icmpChecksum(sendBuffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader));
-
-    if (isConnectionRequest) {
-        if (packetlen + sizeof(nonce) > bufferSize)
-            throw Exception("Packet to big. caused by nonce");
-        const uint64_t tmp_nonce = Utility::htonll(nonce);
-        strncpy((char*)payloadData + payloadLength,
-                     (const char*)&tmp_nonce,
-                     sizeof(nonce) );
-        payloadLength += sizeof(nonce);
-        isConnectionRequest = false;
+    // over udp the echo header is sent as it is, udp has a checksum of its own
+    if (route.udpPort != 0)
+    {
+        return sendTo(udpFds[route.socket], sendBuffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader), realIp, route);
     }
 
-    int result = sendto(fd, sendBuffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader), 0, (struct sockaddr *)&target, sizeof(struct sockaddr_in));
+    header->chksum = Utility::checksum(sendBuffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader));
+
+    return sendTo(fds[route.socket], sendBuffer + sizeof(IpHeader), payloadLength + sizeof(EchoHeader), realIp, route);
+}
+
+bool Echo::sendTo(int fd, const char *data, int length, uint32_t realIp, const Route &route)
+{
+    struct sockaddr_in target;
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = htonl(realIp);
+    target.sin_port = htons(route.udpPort);
+
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &target;
+    message.msg_namelen = sizeof(target);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+#ifdef IP_PKTINFO
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    if (route.localIp != 0)
+    {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+        struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+        info->ipi_spec_dst.s_addr = htonl(route.localIp);
+    }
+#endif
+
+    int result = sendmsg(fd, &message, 0);
     if (result == -1)
-        syslog(LOG_ERR, "error sending icmp packet: %s", strerror(errno));
+    {
+        syslog(LOG_ERR, "error sending %s packet: %s", route.udpPort != 0 ? "udp" : "icmp", strerror(errno));
+        return false;
+    }
+
+    return true;
 }
 
-int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
+int Echo::receiveFrom(int fd, char *buffer, int length, uint32_t &realIp, Route &route)
 {
     struct sockaddr_in source;
-    int source_addr_len = sizeof(struct sockaddr_in);
 
-    int dataLength = recvfrom(fd, receiveBuffer, bufferSize, 0, (struct sockaddr *)&source, (socklen_t *)&source_addr_len);
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &source;
+    message.msg_namelen = sizeof(source);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+#ifdef IP_PKTINFO
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+#endif
+
+    int dataLength = recvmsg(fd, &message, 0);
+    if (dataLength == -1)
+        return -1;
+
+    realIp = ntohl(source.sin_addr.s_addr);
+    route.udpPort = ntohs(source.sin_port); // 0 for raw sockets
+    route.localIp = 0;
+
+#ifdef IP_PKTINFO
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+            route.localIp = ntohl(((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr.s_addr);
+#endif
+
+    return dataLength;
+}
+
+int Echo::receive(int socket, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, Route &route)
+{
+    int dataLength = receiveFrom(fds[socket], receiveBuffer, bufferSize, realIp, route);
+    route.udpPort = 0;
+    route.socket = socket;
     if (dataLength == -1)
     {
         syslog(LOG_ERR, "error receiving icmp packet: %s", strerror(errno));
@@ -122,7 +293,6 @@ int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
         return -1;
 
     int payloadLength = dataLength - sizeof(IpHeader) - sizeof(EchoHeader);
-    realIp = ntohl(source.sin_addr.s_addr);
     reply = header->type == 0;
     id = ntohs(header->id);
     seq = ntohs(header->seq);
@@ -130,17 +300,29 @@ int Echo::receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq)
     return payloadLength;
 }
 
-uint16_t Echo::icmpChecksum(const char *data, int length)
+int Echo::receiveUdp(int socket, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, Route &route)
 {
-    uint16_t *data16 = (uint16_t *)data;
-    uint32_t sum = 0;
+    // there is no ip header, the payload still goes to the same place
+    int dataLength = receiveFrom(udpFds[socket], receiveBuffer + sizeof(IpHeader), bufferSize - sizeof(IpHeader),
+                                 realIp, route);
+    route.socket = socket;
+    if (dataLength == -1)
+    {
+        syslog(LOG_ERR, "error receiving udp packet: %s", strerror(errno));
+        return -1;
+    }
 
-    for (sum = 0; length > 1; length -= 2)
-        sum += *data16++;
-    if (length == 1)
-        sum += *(unsigned char *)data16;
+    if (dataLength < sizeof(EchoHeader))
+        return -1;
+
+    EchoHeader *header = (EchoHeader *)(receiveBuffer + sizeof(IpHeader));
+    if ((header->type != 0 && header->type != 8) || header->code != 0)
+        return -1;
 
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
+    int payloadLength = dataLength - sizeof(EchoHeader);
+    reply = header->type == 0;
+    id = ntohs(header->id);
+    seq = ntohs(header->seq);
+
+    return payloadLength;
 }
@@ -21,27 +21,56 @@
 #define ECHO_H
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 #include <netinet/ip.h>
 class Echo
 {
 public:
+    // how an echo travels besides the address of the peer, replies have to
+    // take the same way back to get through nats and firewalls
+    struct Route
+    {
+        Route() : udpPort(0), localIp(0), socket(0) { }
+
+        uint16_t udpPort; // of the peer, 0 for icmp
+        uint32_t localIp; // 0 lets the kernel choose
+        int socket;       // index of the local socket
+    };
+
     Echo(int maxPayloadSize);
     ~Echo();
 
-    int getFd() { return fd; }
+    // one socket per local address or interface name instead of a single
+    // unbound one, for hosts with several uplinks
+    void bindSockets(const std::vector<std::string> &interfaces);
+
+    int socketCount() const { return fds.size(); }
+    const std::string &getInterface(int socket) const { return interfaces[socket]; }
+    int getFd(int socket) const { return fds[socket]; }
+    int getUdpFd(int socket) const { return udpFds[socket]; } // -1 while udp is closed
+    bool isUdpOpen() const { return udpFds[0] != -1; }
 
-    void send(int payloadLength, uint32_t realIp, bool reply, uint16_t id,
-              uint16_t seq, const uint64_t &nonce, const unsigned char *key);
-    int receive(uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq);
+    // echoes can also be carried in udp datagrams, port 0 picks any port
+    void openUdp(uint16_t port);
+
+    // set on every socket, so firewall rules can tell our echoes apart
+    void setMark(uint32_t mark);
+
+    // false if the echo could not be sent, e.g. because the interface is down
+    bool send(int payloadLength, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+              const Route &route);
+    int receive(int socket, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, Route &route);
+    int receiveUdp(int socket, uint32_t &realIp, bool &reply, uint16_t &id, uint16_t &seq, Route &route);
 
     char *sendPayloadBuffer() { return sendBuffer + headerSize(); }
     char *receivePayloadBuffer() { return receiveBuffer + headerSize(); }
     char *getReceiveBuffer() { return receiveBuffer; }
 
     static int headerSize();
-    void setConnectionRequest(){ isConnectionRequest = true; }
+    static int udpHeaderSize(); // on the wire, bigger than that of icmp
+
     struct EchoHeader
     {
         uint8_t type;
@@ -52,10 +81,16 @@ public:
     }; // size = 8
     typedef ip IpHeader;
 protected:
-    uint16_t icmpChecksum(const char *data, int length);
+    int openSocket(int type, const std::string &interface, uint16_t port);
+    void closeSockets();
+
+    bool sendTo(int fd, const char *data, int length, uint32_t realIp, const Route &route);
+    int receiveFrom(int fd, char *buffer, int length, uint32_t &realIp, Route &route);
 
-    bool isConnectionRequest;
-    int fd;
+    std::vector<std::string> interfaces; // empty names for unbound sockets
+    std::vector<int> fds;
+    std::vector<int> udpFds;
+    uint32_t mark; // 0 if none
     int bufferSize;
     char *sendBuffer, *receiveBuffer;
 };
@@ -0,0 +1,236 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "fec.h"
+#include "config.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+Fec::Encoder::Encoder()
+{
+    groupSize = 0;
+    automatic = false;
+    group = 0;
+    count = 0;
+    lengthXor = 0;
+    paritySent = 0;
+}
+
+void Fec::Encoder::setGroupSize(int groupSize, bool automatic)
+{
+    this->groupSize = groupSize;
+    this->automatic = automatic;
+    count = 0;
+}
+
+bool Fec::Encoder::isActive(const Time &now) const
+{
+    if (groupSize == 0)
+        return false;
+
+    return !automatic || now < activeUntil;
+}
+
+void Fec::Encoder::lossDetected(const Time &now)
+{
+    activeUntil = now + FEC_AUTO_DURATION;
+}
+
+Time Fec::Encoder::flushDeadline() const
+{
+    return groupStart + FEC_FLUSH_DELAY;
+}
+
+int Fec::Encoder::encode(char *payload, int length, const Time &now)
+{
+    if (count == 0)
+    {
+        parity.assign(length, 0);
+        lengthXor = 0;
+        groupStart = now;
+    }
+    else if (length > (int)parity.size())
+    {
+        parity.resize(length, 0);
+    }
+
+    for (int i = 0; i < length; i++)
+        parity[i] ^= payload[i];
+    lengthXor ^= length;
+
+    memmove(payload + sizeof(Header), payload, length);
+
+    Header *header = (Header *)payload;
+    header->group = htons(group);
+    header->index = count;
+    header->count = 0;
+
+    count++;
+
+    return length + sizeof(Header);
+}
+
+int Fec::Encoder::writeParity(char *payload)
+{
+    Header *header = (Header *)payload;
+    header->group = htons(group);
+    header->index = count;
+    header->count = count;
+
+    uint16_t *length = (uint16_t *)(payload + sizeof(Header));
+    *length = htons(lengthXor);
+
+    memcpy(payload + overhead(), &parity[0], parity.size());
+
+    group++;
+    count = 0;
+    paritySent++;
+
+    return overhead() + parity.size();
+}
+
+Fec::Decoder::Decoder()
+{
+    recovered = 0;
+}
+
+Fec::Decoder::Group &Fec::Decoder::getGroup(uint16_t number)
+{
+    for (deque<Group>::iterator group = groups.begin(); group != groups.end(); ++group)
+        if (group->number == number)
+            return *group;
+
+    if (groups.size() == FEC_MAX_GROUPS)
+        groups.pop_front();
+
+    groups.push_back(Group());
+    Group &group = groups.back();
+    group.number = number;
+    group.received = 0;
+    group.count = 0;
+    group.lengthXor = 0;
+    group.recoveredIndex = -1;
+    group.done = false;
+
+    return group;
+}
+
+void Fec::Decoder::add(Group &group, const char *data, int length)
+{
+    if (length > (int)group.data.size())
+        group.data.resize(length, 0);
+
+    for (int i = 0; i < length; i++)
+        group.data[i] ^= data[i];
+}
+
+int Fec::Decoder::receiveData(char *payload, int length)
+{
+    if (length < (int)sizeof(Header))
+        return -1;
+
+    Header header = *(Header *)payload;
+    length -= sizeof(Header);
+    memmove(payload, payload + sizeof(Header), length);
+
+    if (header.index >= FEC_MAX_GROUP_SIZE)
+        return length;
+
+    Group &group = getGroup(ntohs(header.group));
+
+    if (group.received & ((uint64_t)1 << header.index))
+        return -1;
+
+    // already rebuilt from the parity frame
+    if (group.recoveredIndex == header.index)
+        return -1;
+
+    group.received |= (uint64_t)1 << header.index;
+
+    if (!group.done)
+    {
+        add(group, payload, length);
+        group.lengthXor ^= length;
+    }
+
+    return length;
+}
+
+void Fec::Decoder::receiveParity(const char *payload, int length)
+{
+    if (length < overhead())
+        return;
+
+    const Header *header = (const Header *)payload;
+    if (header->count == 0 || header->count > FEC_MAX_GROUP_SIZE)
+        return;
+
+    Group &group = getGroup(ntohs(header->group));
+    if (group.count != 0 || group.done)
+        return;
+
+    group.count = header->count;
+    group.lengthXor ^= ntohs(*(const uint16_t *)(payload + sizeof(Header)));
+    add(group, payload + overhead(), length - overhead());
+}
+
+int Fec::Decoder::recover(char *payload)
+{
+    for (deque<Group>::iterator it = groups.begin(); it != groups.end(); ++it)
+    {
+        if (it->done || it->count == 0)
+            continue;
+
+        int missing = -1;
+        int received = 0;
+        for (int i = 0; i < it->count; i++)
+        {
+            if (it->received & ((uint64_t)1 << i))
+                received++;
+            else
+                missing = i;
+        }
+
+        if (received == it->count)
+        {
+            it->done = true;
+            continue;
+        }
+
+        if (received != it->count - 1)
+            continue;
+
+        it->done = true;
+
+        int length = it->lengthXor;
+        if (length <= 0 || length > (int)it->data.size())
+            continue;
+
+        memcpy(payload, &it->data[0], length);
+        it->recoveredIndex = missing;
+        recovered++;
+
+        return length;
+    }
+
+    return 0;
+}
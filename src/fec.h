@@ -0,0 +1,107 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "time.h"
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+// xor parity over groups of data echoes. one lost packet per group can be
+// rebuilt from the parity frame sent after the group.
+class Fec
+{
+public:
+    struct Header
+    {
+        uint16_t group;
+        uint8_t index;
+        uint8_t count; // number of data packets, only set in parity frames
+    }; // size = 4
+
+    // bytes added to the largest payload, header plus xor of the lengths
+    static int overhead() { return sizeof(Header) + sizeof(uint16_t); }
+
+    class Encoder
+    {
+    public:
+        Encoder();
+
+        void setGroupSize(int groupSize, bool automatic);
+        bool isActive(const Time &now) const;
+        void lossDetected(const Time &now);
+
+        int encode(char *payload, int length, const Time &now);
+        int writeParity(char *payload);
+
+        bool groupComplete() const { return count == groupSize; }
+        bool groupPending() const { return count > 0; }
+        Time flushDeadline() const;
+
+        unsigned int getParitySent() const { return paritySent; }
+
+    protected:
+        int groupSize;
+        bool automatic;
+        Time activeUntil;
+
+        uint16_t group;
+        int count;
+        Time groupStart;
+        std::vector<char> parity;
+        uint16_t lengthXor;
+
+        unsigned int paritySent;
+    };
+
+    class Decoder
+    {
+    public:
+        Decoder();
+
+        int receiveData(char *payload, int length);
+        void receiveParity(const char *payload, int length);
+        int recover(char *payload);
+
+        unsigned int getRecovered() const { return recovered; }
+
+    protected:
+        struct Group
+        {
+            uint16_t number;
+            uint64_t received;
+            int count;
+            std::vector<char> data;
+            uint16_t lengthXor;
+            int recoveredIndex;
+            bool done;
+        };
+
+        Group &getGroup(uint16_t number);
+        void add(Group &group, const char *data, int length);
+
+        std::deque<Group> groups;
+        unsigned int recovered;
+    };
+};
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "filter.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fstream>
+
+using namespace std;
+
+#define NFT "/usr/sbin/nft"
+
+ReplyFilter::ReplyFilter()
+{
+
+}
+
+ReplyFilter::~ReplyFilter()
+{
+    remove();
+}
+
+bool ReplyFilter::install(const char *device)
+{
+#ifdef LINUX
+    ifstream ignoreAll("/proc/sys/net/ipv4/icmp_echo_ignore_all");
+    int ignored = 0;
+    if (ignoreAll >> ignored && ignored != 0)
+    {
+        syslog(LOG_DEBUG, "the kernel ignores echoes, no reply filter needed");
+        return false;
+    }
+
+    if (access(NFT, X_OK) != 0)
+    {
+        syslog(LOG_INFO, "%s not found, the kernel answers the echoes of clients as well", NFT);
+        return false;
+    }
+
+    string name = string("hans_") + device;
+
+    // a table left behind by an earlier run is replaced
+    char commands[1024];
+    snprintf(commands, sizeof(commands),
+             "add table ip %s; delete table ip %s; add table ip %s; "
+             "add set ip %s sessions { typeof ip daddr . icmp id; flags dynamic,timeout; timeout %ds; }; "
+             "add chain ip %s output { type filter hook output priority 0; }; "
+             "add rule ip %s output icmp type echo-reply meta mark 0x%x update @sessions { ip daddr . icmp id } accept; "
+             "add rule ip %s output icmp type echo-reply ip daddr . icmp id @sessions drop",
+             name.c_str(), name.c_str(), name.c_str(), name.c_str(), REPLY_FILTER_TIMEOUT / 1000,
+             name.c_str(), name.c_str(), REPLY_FILTER_MARK, name.c_str());
+
+    if (!run(commands))
+    {
+        syslog(LOG_ERR, "could not install the reply filter");
+        return false;
+    }
+
+    table = name;
+    syslog(LOG_INFO, "kernel replies to client echoes are dropped by nftables table %s", table.c_str());
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ReplyFilter::remove()
+{
+    if (table.empty())
+        return;
+
+    if (!run("delete table ip " + table))
+        syslog(LOG_WARNING, "could not remove nftables table %s", table.c_str());
+
+    table.clear();
+}
+
+bool ReplyFilter::run(const string &commands)
+{
+    string cmdline = string(NFT) + " '" + commands + "'";
+    return system(cmdline.c_str()) == 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <string>
+
+// keeps the kernel from answering the echoes of clients, which are answered
+// by hans, without icmp_echo_ignore_all turning off ping for everyone. an
+// nftables rule remembers the address and echo id of every reply sent by
+// hans, told apart by the mark on its sockets, and drops the other replies
+// going there. ordinary pings are answered by the kernel as before, or by
+// hans with -r, whose replies are marked as well.
+class ReplyFilter
+{
+public:
+    ReplyFilter();
+    ~ReplyFilter();
+
+    bool install(const char *device); // false if it is not needed or could not be
+    void remove();
+    void release() { table.clear(); } // another process removes it
+
+    bool isInstalled() const { return !table.empty(); }
+
+protected:
+    bool run(const std::string &commands);
+
+    std::string table; // one per tunnel device, empty while not installed
+};
+
+#endif
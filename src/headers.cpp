@@ -0,0 +1,367 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "headers.h"
+#include "config.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define IP_HEADER_SIZE 20
+#define TCP_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+
+#define FORMAT_FULL 1
+#define FORMAT_TCP 2
+#define FORMAT_UDP 3
+
+#define TCP_COMPRESSED_SIZE 16
+#define UDP_COMPRESSED_SIZE 6
+#define TCP_FLAG_URG 0x20
+
+static uint32_t read32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+static void write32(char *data, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+static void writeLsb(char *data, uint32_t value)
+{
+    data[0] = value >> 16;
+    data[1] = value >> 8;
+    data[2] = value;
+}
+
+static uint32_t readLsb(const char *data, uint32_t reference)
+{
+    uint32_t lsb = ((uint8_t)data[0] << 16) | ((uint8_t)data[1] << 8) | (uint8_t)data[2];
+
+    // the value closest to the reference with these lower bits
+    int32_t delta = (lsb - reference) & 0xffffff;
+    if (delta >= 0x800000)
+        delta -= 0x1000000;
+
+    return reference + delta;
+}
+
+static int transportHeaderSize(const char *packet)
+{
+    return packet[9] == IPPROTO_TCP ? TCP_HEADER_SIZE : UDP_HEADER_SIZE;
+}
+
+bool HeaderCompression::compressible(const char *packet, int length)
+{
+    // ipv4 without options or fragments
+    if (length < IP_HEADER_SIZE || (uint8_t)packet[0] != 0x45)
+        return false;
+
+    uint16_t totalLength, fragment;
+    memcpy(&totalLength, packet + 2, sizeof(totalLength));
+    memcpy(&fragment, packet + 6, sizeof(fragment));
+    if (ntohs(totalLength) != length || (ntohs(fragment) & 0x3fff) != 0)
+        return false;
+
+    const char *transport = packet + IP_HEADER_SIZE;
+
+    if (packet[9] == IPPROTO_TCP)
+    {
+        int headerSize = ((uint8_t)transport[12] >> 4) * 4;
+        return length >= IP_HEADER_SIZE + TCP_HEADER_SIZE && headerSize >= TCP_HEADER_SIZE &&
+               IP_HEADER_SIZE + headerSize <= length;
+    }
+
+    if (packet[9] == IPPROTO_UDP)
+    {
+        uint16_t udpLength;
+        memcpy(&udpLength, transport + 4, sizeof(udpLength));
+        return length >= IP_HEADER_SIZE + UDP_HEADER_SIZE && ntohs(udpLength) == length - IP_HEADER_SIZE;
+    }
+
+    return false;
+}
+
+void HeaderCompression::setIpChecksum(char *header)
+{
+    header[10] = 0;
+    header[11] = 0;
+
+    uint32_t sum = 0;
+    for (int i = 0; i < IP_HEADER_SIZE; i += 2)
+        sum += ((uint8_t)header[i] << 8) | (uint8_t)header[i + 1];
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    header[10] = ~sum >> 8;
+    header[11] = ~sum;
+}
+
+HeaderCompression::Encoder::Encoder()
+{
+    contexts.resize(HEADER_CONTEXTS);
+    for (int i = 0; i < contexts.size(); i++)
+    {
+        contexts[i].used = false;
+        contexts[i].generation = 0;
+        contexts[i].fullToSend = 0;
+        contexts[i].sinceFull = 0;
+        contexts[i].lastUse = 0;
+    }
+
+    clock = 0;
+    compressed = 0;
+    full = 0;
+    saved = 0;
+}
+
+int HeaderCompression::Encoder::findContext(const char *packet)
+{
+    // protocol, addresses and ports
+    for (int i = 0; i < contexts.size(); i++)
+        if (contexts[i].used && contexts[i].header[9] == packet[9] &&
+            memcmp(contexts[i].header + 12, packet + 12, 12) == 0)
+            return i;
+
+    return -1;
+}
+
+int HeaderCompression::Encoder::encode(char *packet, int length)
+{
+    if (!compressible(packet, length))
+        return length;
+
+    int id = findContext(packet);
+
+    // a new flow takes the context unused for the longest time
+    if (id == -1)
+    {
+        id = 0;
+        for (int i = 1; i < contexts.size(); i++)
+            if (contexts[i].lastUse < contexts[id].lastUse)
+                id = i;
+
+        Context &context = contexts[id];
+        context.used = true;
+        context.generation = (context.generation + 1) & 0x0f;
+        context.fullToSend = HEADER_FULL_REPEAT;
+        context.sinceFull = 0;
+    }
+
+    Context &context = contexts[id];
+    context.lastUse = ++clock;
+
+    // type of service, fragment flags and ttl are only sent in full
+    if (context.fullToSend == 0 && (context.header[1] != packet[1] ||
+        memcmp(context.header + 6, packet + 6, 3) != 0))
+        context.fullToSend = HEADER_FULL_REPEAT;
+
+    // in case the decoder lost its context
+    if (context.fullToSend == 0 && context.sinceFull >= HEADER_REFRESH_PACKETS)
+        context.fullToSend = 1;
+
+    if (context.fullToSend > 0)
+    {
+        context.fullToSend--;
+        context.sinceFull = 0;
+        memcpy(context.header, packet, IP_HEADER_SIZE + transportHeaderSize(packet));
+
+        packet[0] = (FORMAT_FULL << 4) | context.generation;
+        packet[10] = id;
+        packet[11] = 0;
+
+        full++;
+        return length;
+    }
+
+    context.sinceFull++;
+
+    char header[TCP_COMPRESSED_SIZE + 2];
+    int headerSize;
+    int replacedSize = IP_HEADER_SIZE + transportHeaderSize(packet);
+    const char *transport = packet + IP_HEADER_SIZE;
+
+    header[1] = id;
+    memcpy(header + 2, packet + 4, 2); // ip id
+
+    if (packet[9] == IPPROTO_TCP)
+    {
+        header[0] = (FORMAT_TCP << 4) | context.generation;
+        writeLsb(header + 4, read32(transport + 4));
+        writeLsb(header + 7, read32(transport + 8));
+        memcpy(header + 10, transport + 12, 6); // data offset, flags, window, checksum
+        headerSize = TCP_COMPRESSED_SIZE;
+
+        if (transport[13] & TCP_FLAG_URG)
+        {
+            memcpy(header + headerSize, transport + 18, 2);
+            headerSize += 2;
+        }
+    }
+    else
+    {
+        header[0] = (FORMAT_UDP << 4) | context.generation;
+        memcpy(header + 4, transport + 6, 2); // checksum
+        headerSize = UDP_COMPRESSED_SIZE;
+    }
+
+    // tcp options and the payload follow unchanged
+    memmove(packet + headerSize, packet + replacedSize, length - replacedSize);
+    memcpy(packet, header, headerSize);
+
+    compressed++;
+    saved += replacedSize - headerSize;
+
+    return length - replacedSize + headerSize;
+}
+
+HeaderCompression::Decoder::Decoder()
+{
+    contexts.resize(HEADER_CONTEXTS);
+    for (int i = 0; i < contexts.size(); i++)
+        contexts[i].valid = false;
+
+    dropped = 0;
+}
+
+int HeaderCompression::Decoder::decode(char *packet, int length, int maxLength)
+{
+    if (length == 0)
+        return 0;
+
+    int result;
+    switch ((uint8_t)packet[0] >> 4)
+    {
+        case FORMAT_FULL:
+            result = decodeFull(packet, length);
+            break;
+        case FORMAT_TCP:
+            result = decodeTcp(packet, length, maxLength);
+            break;
+        case FORMAT_UDP:
+            result = decodeUdp(packet, length, maxLength);
+            break;
+        default:
+            return length;
+    }
+
+    if (result == 0)
+        dropped++;
+    return result;
+}
+
+int HeaderCompression::Decoder::decodeFull(char *packet, int length)
+{
+    if (length < IP_HEADER_SIZE || (uint8_t)packet[10] >= contexts.size())
+        return 0;
+
+    Context &context = contexts[(uint8_t)packet[10]];
+    uint8_t generation = packet[0] & 0x0f;
+
+    packet[0] = 0x45;
+    setIpChecksum(packet);
+
+    if (!compressible(packet, length))
+        return 0;
+
+    memcpy(context.header, packet, IP_HEADER_SIZE + transportHeaderSize(packet));
+    context.generation = generation;
+    context.valid = true;
+
+    return length;
+}
+
+int HeaderCompression::Decoder::decodeTcp(char *packet, int length, int maxLength)
+{
+    if (length < TCP_COMPRESSED_SIZE || (uint8_t)packet[1] >= contexts.size())
+        return 0;
+
+    // the packets of a lost context are dropped instead of being rebuilt wrong
+    Context &context = contexts[(uint8_t)packet[1]];
+    if (!context.valid || context.generation != (packet[0] & 0x0f) || context.header[9] != IPPROTO_TCP)
+        return 0;
+
+    int headerSize = TCP_COMPRESSED_SIZE + (packet[11] & TCP_FLAG_URG ? 2 : 0);
+    int optionsSize = ((uint8_t)packet[10] >> 4) * 4 - TCP_HEADER_SIZE;
+    if (optionsSize < 0 || headerSize + optionsSize > length)
+        return 0;
+
+    int newLength = length - headerSize + IP_HEADER_SIZE + TCP_HEADER_SIZE;
+    if (newLength > maxLength)
+        return 0;
+
+    char *header = context.header;
+    char *transport = header + IP_HEADER_SIZE;
+
+    uint16_t totalLength = htons(newLength);
+    memcpy(header + 2, &totalLength, 2);
+    memcpy(header + 4, packet + 2, 2);
+    setIpChecksum(header);
+
+    write32(transport + 4, readLsb(packet + 4, read32(transport + 4)));
+    write32(transport + 8, readLsb(packet + 7, read32(transport + 8)));
+    memcpy(transport + 12, packet + 10, 6);
+    if (packet[11] & TCP_FLAG_URG)
+        memcpy(transport + 18, packet + TCP_COMPRESSED_SIZE, 2);
+    else
+        memset(transport + 18, 0, 2);
+
+    memmove(packet + IP_HEADER_SIZE + TCP_HEADER_SIZE, packet + headerSize, length - headerSize);
+    memcpy(packet, header, IP_HEADER_SIZE + TCP_HEADER_SIZE);
+
+    return newLength;
+}
+
+int HeaderCompression::Decoder::decodeUdp(char *packet, int length, int maxLength)
+{
+    if (length < UDP_COMPRESSED_SIZE || (uint8_t)packet[1] >= contexts.size())
+        return 0;
+
+    Context &context = contexts[(uint8_t)packet[1]];
+    if (!context.valid || context.generation != (packet[0] & 0x0f) || context.header[9] != IPPROTO_UDP)
+        return 0;
+
+    int newLength = length - UDP_COMPRESSED_SIZE + IP_HEADER_SIZE + UDP_HEADER_SIZE;
+    if (newLength > maxLength)
+        return 0;
+
+    char *header = context.header;
+    char *transport = header + IP_HEADER_SIZE;
+
+    uint16_t totalLength = htons(newLength);
+    uint16_t udpLength = htons(newLength - IP_HEADER_SIZE);
+    memcpy(header + 2, &totalLength, 2);
+    memcpy(header + 4, packet + 2, 2);
+    setIpChecksum(header);
+
+    memcpy(transport + 4, &udpLength, 2);
+    memcpy(transport + 6, packet + 4, 2);
+
+    memmove(packet + IP_HEADER_SIZE + UDP_HEADER_SIZE, packet + UDP_COMPRESSED_SIZE, length - UDP_COMPRESSED_SIZE);
+    memcpy(packet, header, IP_HEADER_SIZE + UDP_HEADER_SIZE);
+
+    return newLength;
+}
@@ -0,0 +1,100 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HEADERS_H
+#define HEADERS_H
+
+#include <vector>
+#include <stdint.h>
+
+// compresses the ipv4 and tcp or udp headers of tunneled packets against
+// per flow contexts. echoes get lost and reordered, so a compressed header
+// never depends on the one before it: sequence and ack numbers are sent as
+// their lower 24 bits and completed from the last ones the decoder saw.
+//
+// the first byte tells the formats apart from plain ip packets:
+//   0x1g  full packet setting up context, id in the ip checksum field
+//   0x2g  compressed tcp, 0x3g compressed udp
+// g is the generation of the context, it changes when a context is reused
+// for another flow.
+class HeaderCompression
+{
+public:
+    class Encoder
+    {
+    public:
+        Encoder();
+
+        int encode(char *packet, int length); // in place, returns the new length
+
+        unsigned int getCompressed() const { return compressed; }
+        unsigned int getFull() const { return full; }
+        unsigned int getSaved() const { return saved; }
+
+    protected:
+        struct Context
+        {
+            char header[40];  // ip and fixed tcp or udp header last sent in full
+            uint8_t generation;
+            bool used;
+            int fullToSend;   // before headers are compressed
+            int sinceFull;
+            uint32_t lastUse;
+        };
+
+        int findContext(const char *packet);
+
+        std::vector<Context> contexts;
+        uint32_t clock;
+
+        unsigned int compressed;
+        unsigned int full;
+        unsigned int saved;
+    };
+
+    class Decoder
+    {
+    public:
+        Decoder();
+
+        int decode(char *packet, int length, int maxLength); // in place, 0 to drop it
+
+        unsigned int getDropped() const { return dropped; }
+
+    protected:
+        struct Context
+        {
+            char header[40]; // updated with every packet
+            uint8_t generation;
+            bool valid;
+        };
+
+        int decodeFull(char *packet, int length);
+        int decodeTcp(char *packet, int length, int maxLength);
+        int decodeUdp(char *packet, int length, int maxLength);
+
+        std::vector<Context> contexts;
+        unsigned int dropped;
+    };
+
+    static bool compressible(const char *packet, int length);
+    static void setIpChecksum(char *header);
+};
+
+#endif
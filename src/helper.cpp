@@ -0,0 +1,128 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "helper.h"
+#include "tun.h"
+#include "filter.h"
+#include "exception.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+PrivilegedHelper::PrivilegedHelper()
+{
+    fd = -1;
+    pid = -1;
+}
+
+PrivilegedHelper::~PrivilegedHelper()
+{
+    if (fd == -1)
+        return;
+
+    // the helper cleans up and exits when it reads the end of the socket
+    close(fd);
+    waitpid(pid, NULL, 0);
+}
+
+void PrivilegedHelper::start(Tun *tun, ReplyFilter *filter)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw Exception("creating helper socket", true);
+
+    // the commands run by either side must not keep the socket open
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        throw Exception("forking helper", true);
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        fd = fds[1];
+        serve(tun, filter);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    fd = fds[0];
+
+    if (filter != NULL)
+        filter->release();
+}
+
+void PrivilegedHelper::addRoute(uint32_t network, int length)
+{
+    request(TYPE_ADD_ROUTE, network, length);
+}
+
+void PrivilegedHelper::removeRoute(uint32_t network, int length)
+{
+    request(TYPE_REMOVE_ROUTE, network, length);
+}
+
+void PrivilegedHelper::request(int type, uint32_t network, int length)
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.network = network;
+    request.length = length;
+    request.type = type;
+
+    if (send(fd, &request, sizeof(request), 0) != sizeof(request))
+        syslog(LOG_ERR, "could not send request to the privileged helper: %s", strerror(errno));
+}
+
+void PrivilegedHelper::serve(Tun *tun, ReplyFilter *filter)
+{
+    // ^C reaches the whole process group, the server stops on its own and
+    // closes the socket
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+
+    Request request;
+    while (recv(fd, &request, sizeof(request), MSG_WAITALL) == sizeof(request))
+    {
+        // nothing but a route of the tunnel device is ever changed
+        if (request.length < 1 || request.length > 32)
+            continue;
+
+        if (request.type == TYPE_ADD_ROUTE)
+            tun->addRoute(request.network, request.length);
+        else if (request.type == TYPE_REMOVE_ROUTE)
+            tun->removeRoute(request.network, request.length);
+    }
+
+    if (filter != NULL)
+        filter->remove();
+}
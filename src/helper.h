@@ -0,0 +1,67 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef HELPER_H
+#define HELPER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+class Tun;
+class ReplyFilter;
+
+// changes the routes to the tunnel device of the server once privileges
+// were dropped. it is a process of its own, forked while hans still runs
+// as root, which takes no other requests than these. they are queued, so
+// the event loop does not wait for the commands, and the helper logs
+// failures itself. once the server is gone, even if it crashed, the
+// helper removes the reply filter and exits.
+class PrivilegedHelper
+{
+public:
+    PrivilegedHelper();
+    ~PrivilegedHelper();
+
+    void start(Tun *tun, ReplyFilter *filter); // the filter is handed over, it may be NULL
+
+    void addRoute(uint32_t network, int length);
+    void removeRoute(uint32_t network, int length);
+
+protected:
+    enum Type
+    {
+        TYPE_ADD_ROUTE = 1,
+        TYPE_REMOVE_ROUTE = 2
+    };
+
+    struct Request
+    {
+        uint32_t network;
+        uint8_t length;
+        uint8_t type;
+    };
+
+    void request(int type, uint32_t network, int length);
+    void serve(Tun *tun, ReplyFilter *filter);
+
+    int fd; // of our end of the socket pair
+    pid_t pid;
+};
+
+#endif
@@ -20,6 +20,7 @@
 #include "client.h"
 #include "server.h"
 #include "exception.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <arpa/inet.h>
@@ -35,6 +36,8 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <signal.h>
+#include <vector>
+#include <string>
 
 static Worker *worker = NULL;
 
@@ -52,6 +55,12 @@ static void sig_int_handler(int)
         worker->stop();
 }
 
+static void sig_usr1_handler(int)
+{
+    if (worker)
+        worker->requestStatistics();
+}
+
 static void usage()
 {
     printf(
@@ -62,27 +71,66 @@ static void usage()
         "  hans -c server  [-fv]  [-p password] [-u unprivileged_user] [-d tun_device] [-m reference_mtu] [-w polls]\n\n"
         "ARGUMENTS\n"
         "  -s network    Run as a server with the given network address for the virtual interface. Linux only!\n"
-        "  -c server     Connect to a server.\n"
+        "  -c server     Connect to a server. Several addresses of the same server separated\n"
+        "                by commas spread the echoes over all of them. Given several times,\n"
+        "                or with a name that has several addresses, the client connects to\n"
+        "                the server answering first and fails over to another one.\n"
         "  -f            Run in foreground.\n"
         "  -v            Print debug information.\n"
         "  -r            Respond to ordinary pings. Only in server mode.\n"
-        "  -p password   Use a password.(-q is enforced)\n"
+        "  -p password   Use a password.\n"
         "  -u username   Set the user under which the program should run.\n"
         "  -d device     Use the given tun device.\n"
         "  -m mtu        Use this mtu to calculate the tunnel mtu.\n"
         "                The generated echo packets will not be bigger than this value.\n"
-        "                Has to be the same on client and server. Defaults to 1500.\n"
+        "                Clients may use a smaller one than the server, not a bigger one.\n"
+        "                Defaults to 1500.\n"
         "  -w polls      Number of echo requests the client sends to the server for polling.\n"
-        "                0 disables polling. Defaults to 10.\n"
-        "  -i            Change the echo id for every echo request.\n"
+        "                0 disables polling. Defaults to 10. (-q is enforced)\n"
+        "  -i            Spread the echo requests over several echo ids, for firewalls\n"
+        "                that limit each one.\n"
         "  -q            Change the echo sequence number for every echo request.\n"
         "  -a ip         Try to get assigned the given tunnel ip address.\n"
+        "  -l rate       Send at most rate echoes per second. Use rate:burst to set the burst size.\n"
+        "                \"auto\" estimates the rate of icmp policers from losses. Only in client mode.\n"
+        "  -e k          Send a parity echo after every k data echoes to recover single losses.\n"
+        "  -E k          Like -e, but only for a while after losses have been detected.\n"
+        "  -o percent    Pass received packets to the tun device in the order they were sent,\n"
+        "                waiting at most this percentage of the round trip time for missing ones.\n"
+        "                The round trip time is that of the path probes, or the minimum one of\n"
+        "                the polls with a single server. Only in client mode.\n"
+        "  -A            Retransmit lost packets selectively. Only in client mode, not with -e or -E.\n"
+        "  -H rate       Handle at most rate connection requests per second from one address.\n"
+        "                Only in server mode.\n"
+        "  -U port       Also accept echoes in udp datagrams on this port. Clients switch to udp\n"
+        "                while it gets through and fall back to icmp otherwise. Only in server mode.\n"
+        "  -I interfaces Send over these local interfaces, given by name or address and separated\n"
+        "                by commas, and spread the echoes over them. Only in client mode.\n"
+        "  -z            Compress packets in both directions where that makes them smaller.\n"
+        "                Only in client mode.\n"
+        "  -C            Compress the ip and tcp or udp headers of tunneled packets in both\n"
+        "                directions. Only in client mode.\n"
+        "  -M            Leave the mss of tcp connections through the tunnel as it is instead\n"
+        "                of lowering it to what fits into the tunnel.\n"
+        "  -P port       Relay the tcp connections redirected to this port, e.g. with an iptables\n"
+        "                REDIRECT rule, through the server, which opens the actual connections.\n"
+        "                Implies -A. Only in client mode.\n"
+        "  -N            Forward packets between clients directly instead of passing them\n"
+        "                through the tunnel device, where the firewall sees them. Only those\n"
+        "                from the address or routed networks of the sending client are.\n"
+        "                Only in server mode.\n"
+        "  -R prefixes   Have the server route these networks, given as address/length and\n"
+        "                separated by commas, to this client. On the server, clients may only\n"
+        "                have networks within these routed to them, none without -R.\n"
+        "  -K            Leave the kernel answering the echoes of clients as well, instead of\n"
+        "                dropping its replies to them with an nftables rule. Only in server mode.\n\n"
+        "Send SIGUSR1 to log tunnel statistics.\n"
     );
 }
 
 int main(int argc, char *argv[])
 {
-    const char *serverName;
+    std::vector<const char *> serverNames;
     const char *userName = NULL;
     const char *password = "";
     const char *device = NULL;
@@ -99,11 +147,28 @@ int main(int argc, char *argv[])
     bool changeEchoId = false;
     bool changeEchoSeq = false;
     bool verbose = false;
+    int pacingRate = 0;
+    int pacingBurst = 0;
+    bool pacingAdaptive = false;
+    int fecGroupSize = 0;
+    bool fecAutomatic = false;
+    int reorderHoldPercent = 0;
+    bool arq = false;
+    bool compression = false;
+    bool headerCompression = false;
+    bool mssClamping = true;
+    int relayPort = 0;
+    bool hairpinning = false;
+    bool filterReplies = true;
+    int handshakeLimit = 0;
+    int udpPort = 0;
+    const char *interfaceNames = NULL;
+    const char *routeNames = NULL;
 
     openlog(argv[0], LOG_PERROR, LOG_DAEMON);
 
     int c;
-    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qiva:")) != -1)
+    while ((c = getopt(argc, argv, "fru:d:p:s:c:m:w:qiva:l:e:E:o:AH:U:I:zCMP:NR:K")) != -1)
     {
         switch(c) {
             case 'f':
@@ -121,7 +186,7 @@ int main(int argc, char *argv[])
                 break;
             case 'c':
                 isClient = true;
-                serverName = optarg;
+                serverNames.push_back(optarg);
                 break;
             case 's':
                 isServer = true;
@@ -150,16 +215,84 @@ int main(int argc, char *argv[])
             case 'a':
                 clientIp = ntohl(inet_addr(optarg));
                 break;
+            case 'l':
+                if (strcmp(optarg, "auto") == 0)
+                {
+                    pacingAdaptive = true;
+                }
+                else
+                {
+                    pacingRate = atoi(optarg);
+                    if (strchr(optarg, ':') != NULL)
+                        pacingBurst = atoi(strchr(optarg, ':') + 1);
+                    if (pacingRate <= 0 || pacingBurst < 0)
+                        pacingRate = -1;
+                }
+                break;
+            case 'e':
+            case 'E':
+                fecGroupSize = atoi(optarg);
+                fecAutomatic = c == 'E';
+                break;
+            case 'H':
+                handshakeLimit = atoi(optarg);
+                if (handshakeLimit <= 0)
+                    handshakeLimit = -1;
+                break;
+            case 'U':
+                udpPort = atoi(optarg);
+                if (udpPort <= 0 || udpPort > 65535)
+                    udpPort = -1;
+                break;
+            case 'I':
+                interfaceNames = optarg;
+                break;
+            case 'A':
+                arq = true;
+                break;
+            case 'z':
+                compression = true;
+                break;
+            case 'C':
+                headerCompression = true;
+                break;
+            case 'M':
+                mssClamping = false;
+                break;
+            case 'P':
+                relayPort = atoi(optarg);
+                arq = true;
+                break;
+            case 'N':
+                hairpinning = true;
+                break;
+            case 'R':
+                routeNames = optarg;
+                break;
+            case 'K':
+                filterReplies = false;
+                break;
+            case 'o':
+                reorderHoldPercent = atoi(optarg);
+                if (reorderHoldPercent <= 0)
+                    reorderHoldPercent = -1;
+                break;
             default:
                 usage();
                 return 1;
         }
     }
 
-    if (isClient && strcmp(password, "") != 0)
-        changeEchoSeq = true; //enforce. needed for encryption
+    if (isClient && maxPolls != 0)
+        changeEchoSeq = true; //enforce. needed for tracking polls
+
+    // only the headers of the features in use are left out of the tunnel mtu,
+    // echoes in udp datagrams need more room
+    int reservedRoom = arq ? Arq::overhead() : fecGroupSize != 0 ? Fec::overhead() : 0;
+    if (udpPort > 0)
+        reservedRoom += Echo::udpHeaderSize() - Echo::headerSize();
 
-    mtu -= Echo::headerSize() + Worker::headerSize();
+    mtu -= Echo::headerSize() + Worker::headerSize() + reservedRoom;
 
     if (mtu < 68)
     {
@@ -171,7 +304,12 @@ int main(int argc, char *argv[])
     if ((isClient == isServer) ||
         (isServer && network == INADDR_NONE) ||
         (maxPolls < 0 || maxPolls > 255) ||
-        (isServer && (changeEchoSeq || changeEchoId)))
+        (isServer && (changeEchoSeq || changeEchoId)) ||
+        (isServer && pacingAdaptive) || pacingRate < 0 ||
+        (isServer && reorderHoldPercent != 0) || (isServer && arq) || (isServer && compression) || (isServer && headerCompression) || (isServer && relayPort != 0) || relayPort < 0 || relayPort > 65535 || (isClient && hairpinning) || (isClient && !filterReplies) ||
+        (isClient && handshakeLimit != 0) || handshakeLimit < 0 ||
+        (isClient && udpPort != 0) || udpPort < 0 || (isServer && interfaceNames != NULL) || (arq && fecGroupSize != 0) || reorderHoldPercent < 0 || reorderHoldPercent > 100 ||
+        (fecGroupSize != 0 && (fecGroupSize < 2 || fecGroupSize > FEC_MAX_GROUP_SIZE)))
     {
         usage();
         return 1;
@@ -198,31 +336,132 @@ int main(int argc, char *argv[])
 
     signal(SIGTERM, sig_term_handler);
     signal(SIGINT, sig_int_handler);
+    signal(SIGUSR1, sig_usr1_handler);
+    signal(SIGPIPE, SIG_IGN); // relayed connections may be closed while we write
 
     try
     {
+        // routed to the client, or those within which the server routes to clients
+        std::vector<RouteTable::Prefix> routes;
+        if (routeNames != NULL)
+        {
+            char *names = strdup(routeNames);
+            for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+            {
+                char *slash = strchr(name, '/');
+                int length = slash != NULL ? atoi(slash + 1) : 32;
+                if (slash != NULL)
+                    *slash = 0;
+
+                uint32_t network = inet_addr(name);
+                if (network == INADDR_NONE || length < 1 || length > 32)
+                {
+                    printf("invalid prefix: %s\n", name);
+                    return 1;
+                }
+
+                routes.push_back(RouteTable::Prefix(ntohl(network), length));
+            }
+            free(names);
+
+            if (isClient && routes.size() > MAX_CLIENT_ROUTES)
+            {
+                printf("too many prefixes\n");
+                return 1;
+            }
+        }
+
         if (isServer)
         {
-            worker = new Server(mtu, device, password, network, answerPing, uid, gid, 5000);
+            Server *server = new Server(mtu, device, password, network, answerPing, uid, gid, POLL_TIMEOUT, udpPort,
+                                        filterReplies, routes);
+            server->setHandshakeLimit(handshakeLimit);
+            server->setHairpinning(hairpinning);
+            worker = server;
         }
         else
         {
-            uint32_t serverIp = inet_addr(serverName);
-            if (serverIp == INADDR_NONE)
+            std::vector<std::vector<uint32_t> > servers;
+            bool multipath = false;
+
+            for (int i = 0; i < serverNames.size(); i++)
             {
-                struct hostent* he = gethostbyname(serverName);
-                if (!he)
+                std::vector<uint32_t> serverIps;
+
+                char *names = strdup(serverNames[i]);
+                for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
                 {
-                    syslog(LOG_ERR, "gethostbyname: %s", hstrerror(h_errno));
-                    return 1;
+                    uint32_t serverIp = inet_addr(name);
+                    if (serverIp != INADDR_NONE)
+                    {
+                        serverIps.push_back(ntohl(serverIp));
+                        continue;
+                    }
+
+                    struct hostent* he = gethostbyname(name);
+                    if (!he)
+                    {
+                        syslog(LOG_ERR, "gethostbyname: %s", hstrerror(h_errno));
+                        return 1;
+                    }
+
+                    // every address of a name standing alone is a server of its own
+                    if (strchr(serverNames[i], ',') == NULL)
+                    {
+                        for (int j = 0; he->h_addr_list[j] != NULL; j++)
+                            servers.push_back(std::vector<uint32_t>(1, ntohl(*(uint32_t *)he->h_addr_list[j])));
+                        continue;
+                    }
+
+                    serverIps.push_back(ntohl(*(uint32_t *)he->h_addr));
                 }
+                free(names);
+
+                if (serverIps.size() > 1)
+                    multipath = true;
+                if (!serverIps.empty())
+                    servers.push_back(serverIps);
+            }
 
-                serverIp = *(uint32_t *)he->h_addr;
+            if (servers.empty())
+            {
+                usage();
+                return 1;
             }
 
-            worker = new Client(mtu, device, ntohl(serverIp), maxPolls, password, uid, gid, changeEchoId, changeEchoSeq, clientIp);
+            std::vector<std::string> interfaces;
+            if (interfaceNames != NULL)
+            {
+                char *names = strdup(interfaceNames);
+                for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+                    interfaces.push_back(name);
+                free(names);
+            }
+
+            // echoes taking different paths arrive out of order
+            if ((multipath || interfaces.size() > 1) && reorderHoldPercent == 0)
+                reorderHoldPercent = MULTIPATH_REORDER_PERCENT;
+
+            Client *client = new Client(mtu, device, servers, maxPolls, password, uid, gid, changeEchoId, changeEchoSeq, clientIp);
+            if (!interfaces.empty())
+                client->setInterfaces(interfaces);
+            client->setReordering(reorderHoldPercent);
+            client->setArq(arq);
+            client->setCompression(compression);
+            client->setHeaderCompression(headerCompression);
+            if (relayPort != 0)
+                client->setRelay(relayPort);
+            if (!routes.empty())
+                client->setRoutes(routes);
+            worker = client;
         }
 
+        if (pacingRate != 0 || pacingAdaptive)
+            worker->setPacing(pacingRate, pacingBurst, pacingAdaptive);
+        worker->setFec(fecGroupSize, fecAutomatic);
+        worker->setMssClamping(mssClamping);
+        worker->setReservedRoom(reservedRoom);
+
         if (!foreground)
         {
             syslog(LOG_INFO, "detaching from terminal");
@@ -230,6 +469,11 @@ int main(int argc, char *argv[])
         }
 
         worker->run();
+
+        // takes back what was set up on the system
+        Worker *stopped = worker;
+        worker = NULL;
+        delete stopped;
     }
     catch (Exception e)
     {
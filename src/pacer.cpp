@@ -0,0 +1,139 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "pacer.h"
+#include "config.h"
+
+#include <syslog.h>
+
+Pacer::Pacer()
+{
+    rate = 0;
+    burst = 0;
+    adaptive = false;
+    tokens = 0;
+    limited = false;
+    delivered = 0;
+    deliveryRate = 0;
+}
+
+void Pacer::setRate(int rate, int burst, bool adaptive)
+{
+    this->adaptive = adaptive;
+
+    if (adaptive && rate == 0)
+        rate = PACING_INITIAL_RATE;
+
+    this->rate = rate;
+    this->burst = burst != 0 ? burst : rate / 10;
+    if (this->burst < PACING_MIN_BURST)
+        this->burst = PACING_MIN_BURST;
+
+    tokens = this->burst;
+}
+
+void Pacer::refill(const Time &now)
+{
+    if (lastRefill == Time::ZERO)
+        lastRefill = now;
+
+    int elapsed = (now - lastRefill).milliseconds();
+    if (elapsed <= 0)
+        return;
+
+    tokens += (double)elapsed * rate / 1000;
+    if (tokens > burst)
+        tokens = burst;
+
+    lastRefill = now;
+}
+
+bool Pacer::consume(const Time &now)
+{
+    refill(now);
+
+    if (tokens < 1)
+        return false;
+
+    tokens -= 1;
+    return true;
+}
+
+Time Pacer::nextToken(const Time &now)
+{
+    refill(now);
+
+    if (tokens >= 1)
+        return now;
+
+    int wait = (int)((1 - tokens) * 1000 / rate) + 1;
+    return now + wait;
+}
+
+void Pacer::updateDeliveryRate(const Time &now)
+{
+    if (intervalStart == Time::ZERO)
+        intervalStart = now;
+
+    int elapsed = (now - intervalStart).milliseconds();
+    if (elapsed < PACING_INTERVAL)
+        return;
+
+    deliveryRate = delivered * 1000 / elapsed;
+    delivered = 0;
+    intervalStart = now;
+
+    // probe for a higher rate while the bucket is what limits us
+    if (adaptive && limited && lastDecrease + PACING_INTERVAL < now)
+    {
+        rate += rate / 16 > 0 ? rate / 16 : 1;
+        if (rate > PACING_MAX_RATE)
+            rate = PACING_MAX_RATE;
+    }
+
+    limited = false;
+}
+
+void Pacer::packetsDelivered(int count, const Time &now)
+{
+    delivered += count;
+    updateDeliveryRate(now);
+}
+
+void Pacer::packetsLost(int count, const Time &now)
+{
+    updateDeliveryRate(now);
+
+    if (!adaptive || count == 0 || !(lastDecrease + PACING_INTERVAL < now))
+        return;
+
+    // the policer lets through about what was delivered before the loss
+    int estimate = deliveryRate * 7 / 8;
+    if (estimate >= rate)
+        estimate = rate * 7 / 8;
+    if (estimate < PACING_MIN_RATE)
+        estimate = PACING_MIN_RATE;
+
+    syslog(LOG_DEBUG, "loss detected, reducing echo rate from %d/s to %d/s", rate, estimate);
+
+    rate = estimate;
+    if (tokens > burst)
+        tokens = burst;
+    lastDecrease = now;
+}
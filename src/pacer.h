@@ -0,0 +1,65 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACER_H
+#define PACER_H
+
+#include "time.h"
+
+// token bucket limiting the number of echoes sent per second.
+// in adaptive mode the rate follows the rate at which echoes are delivered
+// when losses occur, which estimates the rate of an icmp policer on the path.
+class Pacer
+{
+public:
+    Pacer();
+
+    void setRate(int rate, int burst, bool adaptive);
+
+    bool isEnabled() const { return rate != 0; }
+    bool isAdaptive() const { return adaptive; }
+    int getRate() const { return rate; }
+    int getBurst() const { return burst; }
+
+    bool consume(const Time &now);
+    Time nextToken(const Time &now);
+    void setLimited() { limited = true; }
+
+    void packetsDelivered(int count, const Time &now);
+    void packetsLost(int count, const Time &now);
+
+protected:
+    void refill(const Time &now);
+    void updateDeliveryRate(const Time &now);
+
+    int rate;
+    int burst;
+    bool adaptive;
+
+    double tokens;
+    Time lastRefill;
+
+    bool limited;
+    int delivered;
+    int deliveryRate;
+    Time intervalStart;
+    Time lastDecrease;
+};
+
+#endif
@@ -0,0 +1,532 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "relay.h"
+#include "exception.h"
+#include "utility.h"
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef LINUX
+#include <linux/netfilter_ipv4.h>
+#endif
+
+using namespace std;
+
+StreamRelay::Stream::Stream()
+{
+    fd = -1;
+    connecting = false;
+
+    sent = 0;
+    peerWritten = 0;
+    readable = false;
+    readClosed = false;
+
+    received = 0;
+    written = 0;
+    reported = 0;
+    peerClosed = false;
+    length = 0;
+    writeClosed = false;
+}
+
+StreamRelay::StreamRelay()
+{
+    listenFd = -1;
+    nextStreamId = 0;
+    lastServed = 0;
+
+    opened = 0;
+    reset = 0;
+    bytesSent = 0;
+    bytesReceived = 0;
+}
+
+static void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void StreamRelay::listen(uint16_t port)
+{
+#ifndef LINUX
+    // without the original destination every connection would be refused
+    throw Exception("relaying connections is only supported on linux");
+#endif
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd == -1)
+        throw Exception("creating relay socket", true);
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(listenFd, (sockaddr *)&address, sizeof(address)) == -1)
+        throw Exception("binding relay socket", true);
+
+    if (::listen(listenFd, 16) == -1)
+        throw Exception("listening on relay socket", true);
+
+    setNonBlocking(listenFd);
+}
+
+void StreamRelay::closeAll()
+{
+    for (StreamMap::iterator it = streams.begin(); it != streams.end(); ++it)
+        if (it->second.fd != -1)
+            close(it->second.fd);
+
+    streams.clear();
+    control.clear();
+}
+
+void StreamRelay::addFds(fd_set &readFds, fd_set &writeFds, int &maxFd)
+{
+    if (listenFd != -1)
+    {
+        FD_SET(listenFd, &readFds);
+        if (listenFd > maxFd)
+            maxFd = listenFd;
+    }
+
+    for (StreamMap::iterator it = streams.begin(); it != streams.end(); ++it)
+    {
+        Stream &stream = it->second;
+        if (stream.fd == -1)
+            continue;
+
+        // reading waits until the peer has room for more
+        bool windowOpen = (int32_t)(stream.peerWritten + RELAY_WINDOW - stream.sent) > 0;
+        if (!stream.connecting && !stream.readClosed && !stream.readable && windowOpen)
+            FD_SET(stream.fd, &readFds);
+
+        if (stream.connecting || !stream.pending.empty())
+            FD_SET(stream.fd, &writeFds);
+
+        if (stream.fd > maxFd)
+            maxFd = stream.fd;
+    }
+}
+
+void StreamRelay::handleFds(const fd_set &readFds, const fd_set &writeFds)
+{
+    if (listenFd != -1 && FD_ISSET(listenFd, &readFds))
+        acceptConnection();
+
+    // streams may be removed on the way
+    vector<uint16_t> ids;
+    for (StreamMap::iterator it = streams.begin(); it != streams.end(); ++it)
+        if (it->second.fd != -1)
+            ids.push_back(it->first);
+
+    for (int i = 0; i < ids.size(); i++)
+    {
+        StreamMap::iterator it = streams.find(ids[i]);
+        if (it == streams.end())
+            continue;
+
+        Stream &stream = it->second;
+
+        if (FD_ISSET(stream.fd, &readFds))
+            stream.readable = true;
+
+        if (!FD_ISSET(stream.fd, &writeFds))
+            continue;
+
+        if (stream.connecting)
+        {
+            int error = 0;
+            socklen_t size = sizeof(error);
+            if (getsockopt(stream.fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0)
+            {
+                syslog(LOG_DEBUG, "relayed connection failed: %s", strerror(error));
+                resetStream(ids[i], true);
+                continue;
+            }
+
+            stream.connecting = false;
+        }
+
+        writePending(ids[i], stream);
+    }
+}
+
+void StreamRelay::acceptConnection()
+{
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    if (streams.size() >= RELAY_MAX_STREAMS)
+    {
+        syslog(LOG_WARNING, "too many relayed connections");
+        close(fd);
+        return;
+    }
+
+    // where the connection was going before it was redirected to us. one made
+    // to the relay port directly, from anywhere on our network, is refused,
+    // the server would open it to our address as seen from its own network.
+    sockaddr_in destination;
+    sockaddr_in local;
+    socklen_t size = sizeof(destination);
+    socklen_t localSize = sizeof(local);
+    bool redirected = false;
+#ifdef LINUX
+    redirected = getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &destination, &size) == 0 &&
+                 getsockname(fd, (sockaddr *)&local, &localSize) == 0 &&
+                 (destination.sin_addr.s_addr != local.sin_addr.s_addr || destination.sin_port != local.sin_port);
+#endif
+    if (!redirected)
+    {
+        syslog(LOG_DEBUG, "refusing connection that was not redirected to the relay");
+        close(fd);
+        return;
+    }
+
+    setNonBlocking(fd);
+
+    while (streams.count(nextStreamId))
+        nextStreamId++;
+    uint16_t id = nextStreamId++;
+
+    streams[id].fd = fd;
+    opened++;
+
+    syslog(LOG_DEBUG, "relaying connection to %s:%d",
+           Utility::formatIp(ntohl(destination.sin_addr.s_addr)).c_str(), ntohs(destination.sin_port));
+
+    queueControl(KIND_OPEN, id, ntohl(destination.sin_addr.s_addr));
+    control.back().insert(control.back().end(), (char *)&destination.sin_port,
+                          (char *)&destination.sin_port + sizeof(destination.sin_port));
+}
+
+void StreamRelay::openConnection(uint16_t id, uint32_t ip, uint16_t port)
+{
+    StreamMap::iterator it = streams.find(id);
+    if (it != streams.end() && it->second.fd != -1)
+        return;
+
+    // the tunnel does not reach the loopback of the server either
+    if ((ip >> 24) == 127 || (it == streams.end() && streams.size() >= RELAY_MAX_STREAMS))
+    {
+        resetStream(id, true);
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "creating relayed connection: %s", strerror(errno));
+        resetStream(id, true);
+        return;
+    }
+
+    setNonBlocking(fd);
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(ip);
+    address.sin_port = port;
+
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        resetStream(id, true);
+        return;
+    }
+
+    syslog(LOG_DEBUG, "relaying connection to %s:%d", Utility::formatIp(ip).c_str(), ntohs(port));
+
+    Stream &stream = streams[id];
+    stream.fd = fd;
+    stream.connecting = true;
+    opened++;
+}
+
+void StreamRelay::receiveFrame(const char *frame, int length)
+{
+    if (length < sizeof(Header))
+        return;
+
+    const Header *header = (const Header *)frame;
+    uint16_t id = ntohs(header->stream);
+    uint32_t value = ntohl(header->value);
+    const char *data = frame + sizeof(Header);
+    int dataLength = length - sizeof(Header);
+
+    // the frames may overtake the one opening the stream on the server
+    StreamMap::iterator it = streams.find(id);
+    if (it == streams.end() && listenFd == -1 && (header->kind == KIND_DATA || header->kind == KIND_CLOSE))
+    {
+        if (streams.size() >= RELAY_MAX_STREAMS)
+        {
+            resetStream(id, true);
+            return;
+        }
+        it = streams.insert(make_pair(id, Stream())).first;
+    }
+
+    if (header->kind == KIND_OPEN)
+    {
+        uint16_t port;
+        if (listenFd != -1 || dataLength < sizeof(port))
+            return;
+
+        memcpy(&port, data, sizeof(port));
+        openConnection(id, value, port);
+        return;
+    }
+
+    if (it == streams.end())
+        return;
+
+    Stream &stream = it->second;
+
+    switch (header->kind)
+    {
+        case KIND_DATA:
+            receiveData(id, stream, value, data, dataLength);
+            break;
+        case KIND_WINDOW:
+            if ((int32_t)(value - stream.peerWritten) > 0)
+                stream.peerWritten = value;
+            break;
+        case KIND_CLOSE:
+            stream.peerClosed = true;
+            stream.length = value;
+            writePending(id, stream);
+            break;
+        case KIND_RESET:
+            resetStream(id, false);
+            break;
+    }
+}
+
+void StreamRelay::receiveData(uint16_t id, Stream &stream, uint32_t offset, const char *data, int length)
+{
+    // the peer keeps to the window, or it could make us buffer without end
+    if ((int32_t)(offset + length - stream.written) > RELAY_WINDOW)
+    {
+        syslog(LOG_DEBUG, "relayed stream exceeds its window");
+        resetStream(id, true);
+        return;
+    }
+
+    if ((int32_t)(offset - stream.received) > 0)
+    {
+        stream.outOfOrder[offset].assign(data, data + length);
+        return;
+    }
+
+    // retransmitted frames have the same offsets as before
+    uint32_t skip = stream.received - offset;
+    if (skip < length)
+    {
+        stream.pending.insert(stream.pending.end(), data + skip, data + length);
+        stream.received += length - skip;
+        bytesReceived += length - skip;
+    }
+
+    map<uint32_t, vector<char> >::iterator next;
+    while ((next = stream.outOfOrder.find(stream.received)) != stream.outOfOrder.end())
+    {
+        stream.pending.insert(stream.pending.end(), next->second.begin(), next->second.end());
+        stream.received += next->second.size();
+        bytesReceived += next->second.size();
+        stream.outOfOrder.erase(next);
+    }
+
+    writePending(id, stream);
+}
+
+void StreamRelay::writePending(uint16_t id, Stream &stream)
+{
+    if (stream.fd == -1 || stream.connecting)
+        return;
+
+    while (!stream.pending.empty())
+    {
+        char buffer[4096];
+        int length = stream.pending.size() < sizeof(buffer) ? stream.pending.size() : sizeof(buffer);
+        copy(stream.pending.begin(), stream.pending.begin() + length, buffer);
+
+        int result = send(stream.fd, buffer, length, 0);
+        if (result == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            resetStream(id, true);
+            return;
+        }
+
+        stream.pending.erase(stream.pending.begin(), stream.pending.begin() + result);
+        stream.written += result;
+    }
+
+    // the peer may send more
+    if (stream.written - stream.reported >= RELAY_WINDOW / 4)
+    {
+        queueControl(KIND_WINDOW, id, stream.written);
+        stream.reported = stream.written;
+    }
+
+    if (stream.peerClosed && !stream.writeClosed && stream.written == stream.length)
+    {
+        shutdown(stream.fd, SHUT_WR);
+        stream.writeClosed = true;
+    }
+
+    if (finished(stream))
+    {
+        close(stream.fd);
+        streams.erase(id);
+    }
+}
+
+bool StreamRelay::finished(const Stream &stream) const
+{
+    return stream.readClosed && stream.writeClosed;
+}
+
+void StreamRelay::resetStream(uint16_t id, bool notifyPeer)
+{
+    StreamMap::iterator it = streams.find(id);
+    if (it != streams.end())
+    {
+        // the application sees a reset as well
+        if (it->second.fd != -1)
+        {
+            linger abort;
+            abort.l_onoff = 1;
+            abort.l_linger = 0;
+            setsockopt(it->second.fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+            close(it->second.fd);
+        }
+
+        streams.erase(it);
+    }
+
+    if (notifyPeer)
+        queueControl(KIND_RESET, id, 0);
+
+    reset++;
+}
+
+void StreamRelay::queueControl(int kind, uint16_t id, uint32_t value)
+{
+    Header header;
+    header.kind = kind;
+    header.reserved = 0;
+    header.stream = htons(id);
+    header.value = htonl(value);
+
+    control.push_back(vector<char>((char *)&header, (char *)&header + sizeof(header)));
+}
+
+int StreamRelay::nextFrame(char *frame, int maxLength)
+{
+    if (!control.empty())
+    {
+        vector<char> &next = control.front();
+        memcpy(frame, &next[0], next.size());
+
+        int length = next.size();
+        control.pop_front();
+        return length;
+    }
+
+    if (streams.empty())
+        return 0;
+
+    // streams take turns, starting after the one served last
+    StreamMap::iterator it = streams.upper_bound(lastServed);
+    for (int i = 0; i < streams.size(); i++, ++it)
+    {
+        if (it == streams.end())
+            it = streams.begin();
+
+        Stream &stream = it->second;
+        int32_t window = stream.peerWritten + RELAY_WINDOW - stream.sent;
+        if (stream.fd == -1 || stream.connecting || !stream.readable || stream.readClosed || window <= 0)
+            continue;
+
+        int size = maxLength - sizeof(Header);
+        if (size > window)
+            size = window;
+
+        int result = recv(stream.fd, frame + sizeof(Header), size, 0);
+        if (result == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                stream.readable = false;
+                continue;
+            }
+
+            resetStream(it->first, true);
+            return nextFrame(frame, maxLength);
+        }
+
+        uint16_t id = it->first;
+        lastServed = id;
+
+        Header *header = (Header *)frame;
+        header->reserved = 0;
+        header->stream = htons(id);
+        header->value = htonl(stream.sent);
+
+        if (result == 0)
+        {
+            header->kind = KIND_CLOSE;
+            stream.readClosed = true;
+
+            if (finished(stream))
+            {
+                close(stream.fd);
+                streams.erase(id);
+            }
+            return sizeof(Header);
+        }
+
+        header->kind = KIND_DATA;
+        stream.sent += result;
+        bytesSent += result;
+
+        return sizeof(Header) + result;
+    }
+
+    return 0;
+}
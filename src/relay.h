@@ -0,0 +1,118 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <sys/select.h>
+
+// relays tcp connections as byte streams over the tunnel. the client accepts
+// the connections redirected to it and the server opens the real ones. the
+// frames are sent with arq, which does not keep them in order, so data
+// frames carry their offset in the stream. every stream has a window of
+// RELAY_WINDOW bytes the receiver has not yet written to its socket.
+class StreamRelay
+{
+public:
+    enum Kind
+    {
+        KIND_OPEN   = 1, // value is the destination ip, its port follows
+        KIND_DATA   = 2, // value is the offset of the data following
+        KIND_WINDOW = 3, // value is the number of bytes written to the socket
+        KIND_CLOSE  = 4, // value is the length of the stream
+        KIND_RESET  = 5
+    };
+
+    struct Header
+    {
+        uint8_t kind;
+        uint8_t reserved;
+        uint16_t stream;
+        uint32_t value;
+    }; // size = 8
+
+    StreamRelay();
+
+    void listen(uint16_t port); // accept connections, as the client
+    void closeAll();
+
+    void addFds(fd_set &readFds, fd_set &writeFds, int &maxFd);
+    void handleFds(const fd_set &readFds, const fd_set &writeFds);
+
+    void receiveFrame(const char *frame, int length);
+    int nextFrame(char *frame, int maxLength); // 0 if there is nothing to send
+
+    int getStreams() const { return streams.size(); }
+    unsigned int getOpened() const { return opened; }
+    unsigned int getReset() const { return reset; }
+    uint64_t getBytesSent() const { return bytesSent; }
+    uint64_t getBytesReceived() const { return bytesReceived; }
+
+protected:
+    struct Stream
+    {
+        Stream();
+
+        int fd;
+        bool connecting; // until the connection of the server is established
+
+        // from the socket to the peer
+        uint32_t sent;         // bytes read from the socket
+        uint32_t peerWritten;  // bytes the peer reported written to its socket
+        bool readable;         // until a read would block
+        bool readClosed;
+
+        // from the peer to the socket
+        uint32_t received;     // bytes received in order
+        uint32_t written;      // bytes written to the socket
+        uint32_t reported;     // bytes reported written to the peer
+        std::deque<char> pending;
+        std::map<uint32_t, std::vector<char> > outOfOrder;
+        bool peerClosed;
+        uint32_t length;       // of the stream, once the peer closed it
+        bool writeClosed;
+    };
+
+    typedef std::map<uint16_t, Stream> StreamMap;
+
+    void acceptConnection();
+    void openConnection(uint16_t id, uint32_t ip, uint16_t port);
+    void receiveData(uint16_t id, Stream &stream, uint32_t offset, const char *data, int length);
+    void writePending(uint16_t id, Stream &stream);
+    void resetStream(uint16_t id, bool notifyPeer);
+    bool finished(const Stream &stream) const;
+    void queueControl(int kind, uint16_t id, uint32_t value);
+
+    int listenFd;
+    StreamMap streams;
+    std::deque<std::vector<char> > control; // frames sent before any data
+    uint16_t nextStreamId;
+    uint16_t lastServed; // streams take turns sending
+
+    unsigned int opened;
+    unsigned int reset;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+};
+
+#endif
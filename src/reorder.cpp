@@ -0,0 +1,113 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "reorder.h"
+#include "config.h"
+
+using namespace std;
+
+ReorderBuffer::ReorderBuffer()
+{
+    next = 0;
+    initialized = false;
+    reordered = 0;
+    gapsSkipped = 0;
+}
+
+void ReorderBuffer::start(uint32_t counter)
+{
+    if (!initialized)
+    {
+        initialized = true;
+        next = counter;
+    }
+}
+
+void ReorderBuffer::insert(uint32_t counter, const char *data, int length, const Time &now)
+{
+    start(counter);
+
+    // arrived ahead of a gap, or after the gap has been given up on
+    if (counter != next || !entries.empty())
+        reordered++;
+
+    Entry &entry = entries[counter];
+    entry.data.assign(data, data + length);
+    entry.arrived = now;
+}
+
+void ReorderBuffer::skip(uint32_t counter, const Time &now)
+{
+    start(counter);
+
+    if (counter < next)
+        return;
+
+    if (counter == next && entries.empty())
+    {
+        next++;
+        return;
+    }
+
+    entries[counter].arrived = now;
+}
+
+Time ReorderBuffer::deadline() const
+{
+    Time oldest;
+
+    for (EntryMap::const_iterator entry = entries.begin(); entry != entries.end(); ++entry)
+        if (oldest == Time::ZERO || entry->second.arrived < oldest)
+            oldest = entry->second.arrived;
+
+    return oldest + holdTime;
+}
+
+bool ReorderBuffer::release(vector<char> &packet, const Time &now)
+{
+    while (!entries.empty())
+    {
+        EntryMap::iterator entry = entries.begin();
+
+        if (entry->first > next)
+        {
+            // wait for the missing packets unless that took too long already
+            if (entries.size() < REORDER_MAX_PACKETS && now < deadline())
+                return false;
+
+            gapsSkipped++;
+            next = entry->first;
+        }
+
+        // packets behind next arrived after their gap has been given up on
+        if (entry->first == next)
+            next++;
+
+        bool hasData = !entry->second.data.empty();
+        if (hasData)
+            packet.swap(entry->second.data);
+
+        entries.erase(entry);
+
+        if (hasData)
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,69 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "time.h"
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+// holds received packets back until they can be passed on in the order of
+// their packet counters, or until the oldest one has waited for holdTime
+class ReorderBuffer
+{
+public:
+    ReorderBuffer();
+
+    void setHoldTime(const Time &holdTime) { this->holdTime = holdTime; }
+
+    void insert(uint32_t counter, const char *data, int length, const Time &now);
+    void skip(uint32_t counter, const Time &now); // counter used by an echo without data
+    bool release(std::vector<char> &packet, const Time &now);
+
+    bool isEmpty() const { return entries.empty(); }
+    int size() const { return entries.size(); }
+    Time deadline() const;
+
+    unsigned int getReordered() const { return reordered; }
+    unsigned int getGapsSkipped() const { return gapsSkipped; }
+
+protected:
+    struct Entry
+    {
+        std::vector<char> data; // empty for skipped counters
+        Time arrived;
+    };
+
+    typedef std::map<uint32_t, Entry> EntryMap;
+
+    void start(uint32_t counter);
+
+    EntryMap entries;
+    uint32_t next;
+    bool initialized;
+    Time holdTime;
+
+    unsigned int reordered;
+    unsigned int gapsSkipped;
+};
+
+#endif
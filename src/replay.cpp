@@ -0,0 +1,79 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "replay.h"
+
+ReplayWindow::ReplayWindow()
+{
+    top = 0;
+    bitmap = 0;
+    initialized = false;
+}
+
+bool ReplayWindow::check(uint32_t counter) const
+{
+    if (!initialized || counter > top)
+        return true;
+
+    uint32_t offset = top - counter;
+    if (offset >= SIZE)
+        return false;
+
+    return (bitmap & ((uint64_t)1 << offset)) == 0;
+}
+
+int ReplayWindow::update(uint32_t counter)
+{
+    if (!initialized)
+    {
+        initialized = true;
+        top = counter;
+        bitmap = 1;
+        return 0;
+    }
+
+    if (counter > top)
+    {
+        uint32_t shift = counter - top;
+        bitmap = shift >= SIZE ? 0 : bitmap << shift;
+        bitmap |= 1;
+        top = counter;
+        return shift - 1;
+    }
+
+    uint32_t offset = top - counter;
+    if (offset < SIZE)
+        bitmap |= (uint64_t)1 << offset;
+
+    return 0;
+}
+
+uint32_t ReplayWindow::expand(uint32_t low, int bits) const
+{
+    int64_t window = (int64_t)1 << bits;
+    int64_t expected = initialized ? (int64_t)top + 1 : 0;
+    int64_t counter = (expected & ~(window - 1)) | low;
+
+    if (counter + window / 2 <= expected && counter + window <= 0xffffffffll)
+        counter += window;
+    else if (counter > expected + window / 2 && counter >= window)
+        counter -= window;
+
+    return counter;
+}
@@ -0,0 +1,48 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+// sliding window over the packet counters received, rejects duplicates and
+// counters too far behind the highest one seen
+class ReplayWindow
+{
+public:
+    ReplayWindow();
+
+    bool check(uint32_t counter) const;
+    int update(uint32_t counter); // returns the number of counters skipped
+
+    uint32_t highest() const { return top; }
+
+    // the counter closest to the highest one that ends in these bits
+    uint32_t expand(uint32_t low, int bits) const;
+
+    static const uint32_t SIZE = 64;
+
+protected:
+    uint32_t top;
+    uint64_t bitmap;
+    bool initialized;
+};
+
+#endif
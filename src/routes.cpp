@@ -0,0 +1,142 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "routes.h"
+
+using namespace std;
+
+static uint32_t mask(int length)
+{
+    return length == 0 ? 0 : 0xffffffff << (32 - length);
+}
+
+RouteTable::Prefix::Prefix(uint32_t network, int length)
+{
+    this->network = network & mask(length);
+    this->length = length;
+}
+
+bool RouteTable::Prefix::operator<(const Prefix &other) const
+{
+    // shorter prefixes first, longer ones are expanded over them
+    if (length != other.length)
+        return length < other.length;
+    return network < other.network;
+}
+
+bool RouteTable::Prefix::operator==(const Prefix &other) const
+{
+    return network == other.network && length == other.length;
+}
+
+bool RouteTable::Prefix::overlaps(const Prefix &other) const
+{
+    int shorter = length < other.length ? length : other.length;
+    return ((network ^ other.network) & mask(shorter)) == 0;
+}
+
+bool RouteTable::Prefix::contains(const Prefix &other) const
+{
+    return length <= other.length && ((network ^ other.network) & mask(length)) == 0;
+}
+
+RouteTable::RouteTable()
+{
+    rebuild();
+}
+
+void RouteTable::insert(const Prefix &prefix, uint32_t value)
+{
+    prefixes[prefix] = value;
+    rebuild();
+}
+
+void RouteTable::remove(const Prefix &prefix)
+{
+    if (prefixes.erase(prefix))
+        rebuild();
+}
+
+uint32_t RouteTable::find(const Prefix &prefix) const
+{
+    PrefixMap::const_iterator it = prefixes.find(prefix);
+    return it == prefixes.end() ? 0 : it->second;
+}
+
+int RouteTable::addNode()
+{
+    Entry empty;
+    empty.value = 0;
+    empty.child = -1;
+
+    entries.insert(entries.end(), 256, empty);
+    return entries.size() / 256 - 1;
+}
+
+void RouteTable::rebuild()
+{
+    entries.clear();
+    addNode();
+
+    for (PrefixMap::const_iterator it = prefixes.begin(); it != prefixes.end(); ++it)
+    {
+        const Prefix &prefix = it->first;
+
+        // down to the node the prefix ends in
+        int node = 0;
+        int shift = 24;
+        while (prefix.length > 32 - shift)
+        {
+            int index = node * 256 + ((prefix.network >> shift) & 0xff);
+            if (entries[index].child == -1)
+            {
+                int child = addNode();
+                entries[index].child = child;
+            }
+
+            node = entries[index].child;
+            shift -= 8;
+        }
+
+        // and over all the entries it covers there
+        int first = (prefix.network >> shift) & 0xff;
+        int count = 1 << (32 - shift - prefix.length);
+        for (int i = first; i < first + count; i++)
+            entries[node * 256 + i].value = it->second;
+    }
+}
+
+uint32_t RouteTable::lookup(uint32_t ip) const
+{
+    uint32_t value = 0;
+    int node = 0;
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        const Entry &entry = entries[node * 256 + ((ip >> shift) & 0xff)];
+        if (entry.value != 0)
+            value = entry.value;
+        if (entry.child == -1)
+            break;
+
+        node = entry.child;
+    }
+
+    return value;
+}
@@ -0,0 +1,73 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include <stdint.h>
+#include <vector>
+#include <map>
+
+// longest prefix match over ipv4 prefixes. a multibit trie with a stride of
+// 8 bits, prefixes are expanded to the node they end in, so a lookup takes
+// at most four steps however many prefixes there are. the trie is rebuilt
+// on every change, they only come with clients connecting and leaving.
+class RouteTable
+{
+public:
+    struct Prefix
+    {
+        Prefix() : network(0), length(0) { }
+        Prefix(uint32_t network, int length);
+
+        bool operator<(const Prefix &other) const;
+        bool operator==(const Prefix &other) const;
+        bool overlaps(const Prefix &other) const;
+        bool contains(const Prefix &other) const;
+
+        uint32_t network;
+        int length;
+    };
+
+    RouteTable();
+
+    void insert(const Prefix &prefix, uint32_t value); // value must not be 0
+    void remove(const Prefix &prefix);
+    uint32_t find(const Prefix &prefix) const;  // value of exactly this prefix, 0 if it is not there
+    uint32_t lookup(uint32_t ip) const;         // value of the longest matching prefix, 0 if none
+
+    int size() const { return prefixes.size(); }
+
+protected:
+    struct Entry
+    {
+        uint32_t value;
+        int child; // node of the next 8 bits, -1 if there is none
+    };
+
+    typedef std::map<Prefix, uint32_t> PrefixMap;
+
+    void rebuild();
+    int addNode();
+
+    PrefixMap prefixes;
+    std::vector<Entry> entries; // 256 for every node, the root first
+};
+
+#endif
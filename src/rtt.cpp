@@ -0,0 +1,70 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "rtt.h"
+#include "config.h"
+
+RttEstimator::RttEstimator()
+{
+    smoothed = 0;
+    variance = 0;
+    minimum = 0;
+    samples = 0;
+}
+
+void RttEstimator::addSample(const Time &sample, const Time &now)
+{
+    int ms = sample.milliseconds();
+    if (ms < 0)
+        return;
+
+    if (samples == 0)
+    {
+        smoothed = ms;
+        variance = ms / 2;
+    }
+    else
+    {
+        int delta = smoothed > ms ? smoothed - ms : ms - smoothed;
+        variance = (3 * variance + delta) / 4;
+        smoothed = (7 * smoothed + ms) / 8;
+    }
+
+    if (samples == 0 || ms <= minimum || minimumTaken + RTT_MIN_WINDOW < now)
+    {
+        minimum = ms;
+        minimumTaken = now;
+    }
+
+    samples++;
+}
+
+Time RttEstimator::rto() const
+{
+    if (samples == 0)
+        return Time(RTO_INITIAL);
+
+    int rto = smoothed + (4 * variance > 1 ? 4 * variance : 1);
+    if (rto < RTO_MIN)
+        rto = RTO_MIN;
+    if (rto > RTO_MAX)
+        rto = RTO_MAX;
+
+    return Time(rto);
+}
@@ -0,0 +1,47 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RTT_H
+#define RTT_H
+
+#include "time.h"
+
+// smoothed round trip time and retransmission timeout as in RFC 6298,
+// plus a windowed minimum which is not inflated by polls parked on the server
+class RttEstimator
+{
+public:
+    RttEstimator();
+
+    void addSample(const Time &sample, const Time &now);
+    bool hasSamples() const { return samples != 0; }
+
+    Time srtt() const { return Time(smoothed); }
+    Time minRtt() const { return Time(minimum); }
+    Time rto() const;
+
+protected:
+    int smoothed;
+    int variance;
+    int minimum;
+    Time minimumTaken;
+    unsigned int samples;
+};
+
+#endif
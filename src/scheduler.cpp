@@ -0,0 +1,175 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scheduler.h"
+#include "config.h"
+
+PathScheduler::PathScheduler(int paths)
+    : paths(paths)
+{
+
+}
+
+int PathScheduler::weight(const Path &path, const Time &now) const
+{
+    // a path that loses everything still gets some echoes to notice recovery
+    int share = 1000 - path.loss;
+    if (share < PATH_MIN_SHARE)
+        share = PATH_MIN_SHARE;
+
+    // an overdue probe means the path has stalled, no need to wait for the
+    // loss average to catch up
+    if (path.probePending && !(now < path.probeSent + path.rtt.rto()))
+        share = PATH_MIN_SHARE;
+
+    int rtt = path.rtt.srtt().milliseconds();
+    if (rtt < PATH_MIN_RTT)
+        rtt = PATH_MIN_RTT;
+
+    return share * 1000 / rtt;
+}
+
+int PathScheduler::next(const Time &now)
+{
+    if (paths.size() == 1)
+    {
+        paths[0].sent++;
+        return 0;
+    }
+
+    // paths without samples are treated like the best one until they have some
+    int best = 1;
+    for (std::vector<Path>::iterator path = paths.begin(); path != paths.end(); ++path)
+        if (path->rtt.hasSamples() && weight(*path, now) > best)
+            best = weight(*path, now);
+
+    int total = 0;
+    int chosen = 0;
+    for (int i = 0; i < paths.size(); i++)
+    {
+        int pathWeight = paths[i].rtt.hasSamples() ? weight(paths[i], now) : best;
+
+        paths[i].credit += pathWeight;
+        total += pathWeight;
+
+        if (paths[i].credit > paths[chosen].credit)
+            chosen = i;
+    }
+
+    paths[chosen].credit -= total;
+    paths[chosen].sent++;
+
+    return chosen;
+}
+
+int PathScheduler::probeDue(const Time &now)
+{
+    if (paths.size() == 1)
+        return -1;
+
+    for (int i = 0; i < paths.size(); i++)
+    {
+        Path &path = paths[i];
+        if (now < path.nextProbe)
+            continue;
+
+        // the last probe had a whole interval to come back
+        if (path.probePending)
+        {
+            path.probePending = false;
+            lost(path);
+        }
+
+        return i;
+    }
+
+    return -1;
+}
+
+void PathScheduler::probeSent(int path, uint16_t seq, const Time &now)
+{
+    paths[path].probePending = true;
+    paths[path].probeSeq = seq;
+    paths[path].probeSent = now;
+    paths[path].nextProbe = now + PATH_PROBE_INTERVAL;
+}
+
+void PathScheduler::probeAnswered(uint16_t seq, const Time &now)
+{
+    for (std::vector<Path>::iterator path = paths.begin(); path != paths.end(); ++path)
+    {
+        if (path->probePending && path->probeSeq == seq)
+        {
+            path->probePending = false;
+            path->rtt.addSample(now - path->probeSent, now);
+            delivered(*path);
+            return;
+        }
+    }
+}
+
+Time PathScheduler::probeDeadline() const
+{
+    Time deadline;
+    for (std::vector<Path>::const_iterator path = paths.begin(); path != paths.end(); ++path)
+        if (deadline == Time::ZERO || path->nextProbe < deadline)
+            deadline = path->nextProbe;
+
+    return deadline;
+}
+
+Time PathScheduler::rto() const
+{
+    Time rto;
+    for (std::vector<Path>::const_iterator path = paths.begin(); path != paths.end(); ++path)
+        if (path->rtt.hasSamples() && rto < path->rtt.rto())
+            rto = path->rtt.rto();
+
+    return rto == Time::ZERO ? Time(RTO_INITIAL) : rto;
+}
+
+Time PathScheduler::srtt() const
+{
+    Time srtt;
+    for (std::vector<Path>::const_iterator path = paths.begin(); path != paths.end(); ++path)
+        if (path->rtt.hasSamples() && srtt < path->rtt.srtt())
+            srtt = path->rtt.srtt();
+
+    return srtt;
+}
+
+void PathScheduler::pollAnswered(int path)
+{
+    delivered(paths[path]);
+}
+
+void PathScheduler::pollLost(int path)
+{
+    lost(paths[path]);
+}
+
+void PathScheduler::delivered(Path &path)
+{
+    path.loss -= (path.loss + PATH_LOSS_GAIN - 1) / PATH_LOSS_GAIN;
+}
+
+void PathScheduler::lost(Path &path)
+{
+    path.loss += (1000 - path.loss) / PATH_LOSS_GAIN;
+}
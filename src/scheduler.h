@@ -0,0 +1,78 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "rtt.h"
+#include "time.h"
+
+#include <stdint.h>
+#include <vector>
+
+// spreads echoes over several paths to the server in proportion to the rate
+// each one can deliver. polls wait on the server and say little about a
+// path, so every path is measured with probes the server answers right away.
+class PathScheduler
+{
+public:
+    PathScheduler(int paths);
+
+    int size() const { return paths.size(); }
+
+    int next(const Time &now); // path for the next echo
+
+    int probeDue(const Time &now); // path to probe now, -1 for none
+    void probeSent(int path, uint16_t seq, const Time &now);
+    void probeAnswered(uint16_t seq, const Time &now);
+    Time probeDeadline() const;
+    Time rto() const; // of the slowest path
+    Time srtt() const; // of the slowest path, 0 before a probe came back
+
+    void pollAnswered(int path);
+    void pollLost(int path);
+
+    const RttEstimator &getRtt(int path) const { return paths[path].rtt; }
+    int getLoss(int path) const { return paths[path].loss; } // per mille
+    unsigned int getSent(int path) const { return paths[path].sent; }
+
+protected:
+    struct Path
+    {
+        Path() : loss(0), credit(0), sent(0), probePending(false), probeSeq(0) { }
+
+        RttEstimator rtt;
+        int loss;   // moving average of lost probes and polls, per mille
+        int credit; // for smooth weighted round robin
+        unsigned int sent;
+
+        bool probePending;
+        uint16_t probeSeq;
+        Time probeSent;
+        Time nextProbe;
+    };
+
+    int weight(const Path &path, const Time &now) const;
+    void delivered(Path &path);
+    void lost(Path &path);
+
+    std::vector<Path> paths;
+};
+
+#endif
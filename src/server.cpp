@@ -26,6 +26,8 @@
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <stdio.h>
+#include <time.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -34,15 +36,40 @@ using namespace std;
 const Worker::TunnelHeader::Magic Server::magic("hans");
 
 Server::Server(int tunnelMtu, const char *deviceName, const char *passphrase,
-               uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout)
+               uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
+               uint16_t udpPort, bool filterReplies, const vector<RouteTable::Prefix> &allowedRoutes)
     : Worker(tunnelMtu, deviceName, answerEcho, uid, gid), auth(passphrase)
 {
     this->network = network & 0xffffff00;
     this->pollTimeout = pollTimeout;
+    this->pollExpiry = pollTimeout > 2 * POLL_EXPIRY_MARGIN ? pollTimeout - POLL_EXPIRY_MARGIN : pollTimeout / 2;
+    this->pollTimerArmed = false;
     this->latestAssignedIpOffset = FIRST_ASSIGNED_IP_OFFSET - 1;
+    this->handshakeLimit = 0;
+    this->hairpinning = false;
+    this->sender = NULL;
+    this->hairpinned = 0;
+    this->fragmentedPackets = 0;
+    this->mtuReports = 0;
+    this->handshakeSecond = 0;
+    this->udpPort = udpPort;
+    this->allowedRoutes = allowedRoutes;
+
+    Utility::randomBytes((char *)cookieSecret, sizeof(cookieSecret));
+
+    if (udpPort != 0)
+        echo->openUdp(udpPort);
 
     tun->setIp(this->network + 1, this->network + 2, true);
 
+    // the kernel would answer the echoes of clients as well
+    if (filterReplies && replyFilter.install(tun->getDevice()))
+        echo->setMark(REPLY_FILTER_MARK);
+
+    // routing to clients and removing the filter need root after privileges were dropped
+    if (!allowedRoutes.empty() || replyFilter.isInstalled())
+        helper.start(tun, replyFilter.isInstalled() ? &replyFilter : NULL);
+
     dropPrivileges();
 }
 
@@ -51,61 +78,330 @@ Server::~Server()
 
 }
 
+int Server::ClientConnectData::length() const
+{
+    return sizeof(ClientConnectData) + echoIds * sizeof(uint16_t) + routes * ROUTE_SIZE +
+           (flags & FLAG_VERSION_2 ? sizeof(uint16_t) : 0) + (flags & FLAG_TICKET ? TicketIssuer::SIZE : 0) +
+           (flags & FLAG_COOKIE ? CHALLENGE_SIZE + sizeof(Auth::Response) : 0) +
+           (flags & FLAG_PROOF ? sizeof(Auth::Proof) : 0);
+}
+
 void Server::handleUnknownClient(const TunnelHeader &header, int dataLength,
                                  uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
-                                 const uint64_t &nonce, const unsigned char *key)
+                                 const Echo::Route &route, const Session &session)
 {
+    // only used to answer, nothing is kept before the request is authenticated
     ClientData client;
     client.realIp = realIp;
     client.maxPolls = 1;
-    client.nonce = nonce;
-    client.lastseq = echoSeq;
+    client.session = session;
+    client.expiredPolls = 0;
+    client.droppedPackets = 0;
+    client.fecEncoder.setGroupSize(fecGroupSize, fecAutomatic);
+    client.arqEnabled = false;
     client.ID = echoId;
-    memcpy(&client.key, key, crypto_stream_salsa20_KEYBYTES);
+    client.ticketSession = 0;
 
-    // security check .. return when max clients is reached
-    if (clientIDMap.size() >= 65535) // max uint16_t
-        return;
+    pollReceived(&client, realIp, echoId, echoSeq, route);
 
-    // EchoID is unique identifier for client. change it when same already exists
-    while (getClientByID(echoId) != NULL)
-        echoId = Utility::rand();
+    if (!handshakeAllowed(realIp))
+    {
+        syslog(LOG_DEBUG, "too many connection requests from %s", Utility::formatIp(realIp).c_str());
+        return;
+    }
 
-    pollReceived(&client, echoId, echoSeq);
+    ClientConnectData *connectData = (ClientConnectData *)echoReceivePayloadBuffer();
 
     if (header.type != TunnelHeader::TYPE_CONNECTION_REQUEST ||
-            dataLength != sizeof(ClientConnectData))
+            dataLength < sizeof(ClientConnectData) || dataLength != connectData->length() ||
+            connectData->echoIds > MAX_ECHO_IDS || connectData->routes > MAX_CLIENT_ROUTES)
     {
         syslog(LOG_DEBUG, "invalid request %s", Utility::formatIp(realIp).c_str());
         sendReset(&client);
         return;
     }
 
-    ClientConnectData *connectData = (ClientConnectData *)echoReceivePayloadBuffer();
-
     client.maxPolls = connectData->maxPolls;
+    client.arqEnabled = (connectData->flags & ClientConnectData::FLAG_ARQ) != 0;
+    client.session.compression = (connectData->flags & ClientConnectData::FLAG_COMPRESSION) != 0;
+    client.headerCompression = (connectData->flags & ClientConnectData::FLAG_HEADER_COMPRESSION) != 0;
+    client.relaying = client.arqEnabled && (connectData->flags & ClientConnectData::FLAG_STREAMS) != 0;
+    client.compactHeader = (connectData->flags & ClientConnectData::FLAG_VERSION_2) != 0;
     client.state = ClientData::STATE_NEW;
-    client.tunnelIp = reserveTunnelIp(connectData->desiredIp);
 
-    syslog(LOG_DEBUG, "new client: %s (%s)\n",
-           Utility::formatIp(client.realIp).c_str(),
-           Utility::formatIp(client.tunnelIp).c_str());
+    const char *extension = echoReceivePayloadBuffer() + sizeof(ClientConnectData);
+    for (int i = 0; i < connectData->echoIds; i++)
+    {
+        uint16_t id;
+        memcpy(&id, extension, sizeof(id));
+        extension += sizeof(id);
 
-    if (client.tunnelIp != 0)
+        if (ntohs(id) != echoId)
+            client.echoIds.push_back(ntohs(id));
+    }
+
+    for (int i = 0; i < connectData->routes; i++)
+    {
+        uint32_t routeNetwork;
+        memcpy(&routeNetwork, extension, sizeof(routeNetwork));
+        int routeLength = (uint8_t)extension[sizeof(routeNetwork)];
+        extension += ClientConnectData::ROUTE_SIZE;
+
+        // only within the networks given with -R, never into the tunnel network
+        bool allowed = false;
+        RouteTable::Prefix prefix;
+        if (routeLength >= 1 && routeLength <= 32)
+        {
+            prefix = RouteTable::Prefix(ntohl(routeNetwork), routeLength);
+            for (int j = 0; j < allowedRoutes.size() && !allowed; j++)
+                allowed = allowedRoutes[j].contains(prefix);
+            allowed = allowed && !prefix.overlaps(RouteTable::Prefix(network, 24));
+        }
+
+        if (!allowed)
+        {
+            syslog(LOG_WARNING, "ignoring route %s/%d of %s", Utility::formatIp(ntohl(routeNetwork)).c_str(),
+                   routeLength, Utility::formatIp(realIp).c_str());
+            continue;
+        }
+
+        if (find(client.routes.begin(), client.routes.end(), prefix) == client.routes.end())
+            client.routes.push_back(prefix);
+    }
+
+    // a client on a narrower path gets no bigger packets than it takes
+    client.mtu = tunnelMtu;
+    if (connectData->flags & ClientConnectData::FLAG_VERSION_2)
+    {
+        uint16_t mtu;
+        memcpy(&mtu, extension, sizeof(mtu));
+        extension += sizeof(mtu);
+        mtu = ntohs(mtu);
+
+        if (mtu < 68) // rfc 791
+        {
+            syslog(LOG_DEBUG, "invalid mtu %d of %s", mtu, Utility::formatIp(realIp).c_str());
+            sendReset(&client);
+            return;
+        }
+
+        // its echoes must fit into ours. with -U our tunnel mtu leaves room
+        // for the udp header, that of the client need not.
+        if (mtu > payloadBufferSize())
+            syslog(LOG_WARNING, "mtu %d of %s is bigger than ours, %d", mtu, Utility::formatIp(realIp).c_str(), tunnelMtu);
+        if (mtu < tunnelMtu)
+            client.mtu = mtu;
+    }
+
+    // our tunnel mtu leaves no room for the arq header, packets to a client
+    // using it are made smaller to fit into our echoes
+    int arqMtu = payloadBufferSize() - Arq::overhead() -
+                 (udpPort != 0 ? Echo::udpHeaderSize() - Echo::headerSize() : 0);
+    if (client.arqEnabled && client.mtu > arqMtu)
+        client.mtu = arqMtu;
+
+    // the optional parts follow in the order of their flags
+    const char *ticket = NULL;
+    const char *cookie = NULL;
+    const Auth::Proof *proof = NULL;
+
+    if (connectData->flags & ClientConnectData::FLAG_TICKET)
+    {
+        ticket = extension;
+        extension += TicketIssuer::SIZE;
+    }
+    if (connectData->flags & ClientConnectData::FLAG_COOKIE)
+    {
+        cookie = extension;
+        extension += CHALLENGE_SIZE + sizeof(Auth::Response);
+    }
+    if (connectData->flags & ClientConnectData::FLAG_PROOF)
+        proof = (const Auth::Proof *)extension;
+
+    if (recentNonces.count(session.nonce))
+    {
+        syslog(LOG_DEBUG, "replayed connection request from %s", Utility::formatIp(realIp).c_str());
+        return;
+    }
+
+    // a proof is needed with a ticket too, it makes the request fresh
+    bool proofValid = proof != NULL &&
+        checkProof(client, *proof, (const char *)proof - echoReceivePayloadBuffer());
+
+    uint32_t ticketIp = 0;
+    uint32_t ticketSession = 0;
+    if (ticket != NULL && proofValid && !tickets.open(ticket, ticketIp, ticketSession))
+        ticketIp = 0;
+
+    if (cookie != NULL && checkCookie(client, cookie))
+    {
+        Auth::Response rightResponse = auth.getResponse(Auth::Challenge(cookie, cookie + CHALLENGE_SIZE));
+
+        if (memcmp(&rightResponse, cookie + CHALLENGE_SIZE, sizeof(Auth::Response)) != 0)
+        {
+            syslog(LOG_DEBUG, "wrong challenge response\n");
+            sendEchoToClient(&client, TunnelHeader::TYPE_CHALLENGE_ERROR, 0);
+            return;
+        }
+    }
+    else if (!proofValid)
     {
-        client.challenge = auth.generateChallenge(CHALLENGE_SIZE);
         sendChallenge(&client);
+        return;
+    }
+
+    recentNonces[session.nonce] = time(NULL);
+
+    ClientData *previous = getClientByID(echoId);
+    if (previous != NULL)
+    {
+        syslog(LOG_DEBUG, "reconnecting %s", Utility::formatIp(realIp).c_str());
+        removeClient(previous);
+    }
+
+    // an id can only lead to one client. one of our own earlier session or a
+    // stale one gives it up, a live one keeps it and the client goes without,
+    // it only uses the ids we answer on.
+    for (int i = 0; i < client.echoIds.size(); i++)
+    {
+        if ((previous = getClientByID(client.echoIds[i])) == NULL)
+            continue;
 
-        // add client to list
-        clientList.push_back(client);
-        clientIDMap[echoId] = clientList.size() - 1;
-        clientTunnelIpMap[client.tunnelIp] = clientList.size() - 1;
+        if ((ticketIp != 0 && previous->ticketSession == ticketSession) ||
+            previous->lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+        {
+            removeClient(previous);
+        }
+        else
+        {
+            syslog(LOG_DEBUG, "echo id %d of %s is taken", client.echoIds[i], Utility::formatIp(realIp).c_str());
+            client.echoIds.erase(client.echoIds.begin() + i--);
+        }
     }
-    else
+
+    // the ticket owner takes its address back from its own earlier session or a
+    // stale one, anyone else keeps it and the owner gets a fresh address
+    if (ticketIp != 0 && (previous = getClientByTunnelIp(ticketIp)) != NULL)
+    {
+        if (previous->ticketSession == ticketSession || previous->lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+            removeClient(previous);
+        else
+            syslog(LOG_DEBUG, "ticket address %s is taken", Utility::formatIp(ticketIp).c_str());
+    }
+
+    // a prefix stays with the client it is routed to until that one is gone
+    for (int i = 0; i < client.routes.size(); i++)
+    {
+        const RouteTable::Prefix &prefix = client.routes[i];
+        if ((previous = getClientByRoute(prefix)) == NULL)
+            continue;
+
+        syslog(LOG_WARNING, "ignoring route %s/%d of %s, it overlaps one of %s",
+               Utility::formatIp(prefix.network).c_str(), prefix.length, Utility::formatIp(realIp).c_str(),
+               Utility::formatIp(previous->tunnelIp).c_str());
+        client.routes.erase(client.routes.begin() + i--);
+    }
+
+    client.ticketSession = ticketIp != 0 ? ticketSession : tickets.newSession();
+    client.tunnelIp = reserveTunnelIp(ticketIp != 0 ? ticketIp : connectData->desiredIp);
+
+    if (client.tunnelIp == 0)
     {
         syslog(LOG_WARNING, "server full");
         sendEchoToClient(&client, TunnelHeader::TYPE_SERVER_FULL, 0);
+        return;
+    }
+
+    syslog(LOG_DEBUG, "%s client: %s (%s)\n", ticketIp != 0 ? "resuming" : "new",
+           Utility::formatIp(client.realIp).c_str(),
+           Utility::formatIp(client.tunnelIp).c_str());
+
+    sendConnectionAccept(&client);
+    addClient(client);
+}
+
+void Server::addClient(const ClientData &client)
+{
+    clientList.push_back(client);
+    clientIDMap[client.ID] = clientList.size() - 1;
+    for (int i = 0; i < client.echoIds.size(); i++)
+        clientIDMap[client.echoIds[i]] = clientList.size() - 1;
+    clientTunnelIpMap[client.tunnelIp] = clientList.size() - 1;
+
+    for (int i = 0; i < client.routes.size(); i++)
+    {
+        const RouteTable::Prefix &prefix = client.routes[i];
+        syslog(LOG_DEBUG, "routing %s/%d to %s", Utility::formatIp(prefix.network).c_str(), prefix.length,
+               Utility::formatIp(client.tunnelIp).c_str());
+
+        helper.addRoute(prefix.network, prefix.length);
+        routes.insert(prefix, client.tunnelIp);
+    }
+}
+
+bool Server::handshakeAllowed(uint32_t realIp)
+{
+    if (handshakeLimit == 0)
+        return true;
+
+    time_t current = time(NULL);
+    if (current != handshakeSecond)
+    {
+        handshakeCounts.clear();
+        handshakeSecond = current;
     }
+
+    return ++handshakeCounts[realIp] <= handshakeLimit;
+}
+
+bool Server::checkProof(const ClientData &client, const Auth::Proof &proof, int length)
+{
+    int64_t skew = (int64_t)time(NULL) - ntohl(proof.timestamp);
+    if (skew > PROOF_MAX_CLOCK_SKEW || skew < -PROOF_MAX_CLOCK_SKEW)
+    {
+        syslog(LOG_DEBUG, "proof timestamp off by %d seconds", (int)skew);
+        return false;
+    }
+
+    if (!auth.checkProof(proof, client.session.nonce, echoReceivePayloadBuffer(), length))
+    {
+        syslog(LOG_DEBUG, "invalid proof");
+        return false;
+    }
+
+    return true;
+}
+
+Auth::Challenge Server::getCookie(const ClientData &client, uint32_t epoch)
+{
+    // the response comes with a new connection nonce, so only bind the address
+    unsigned char input[sizeof(uint32_t) + sizeof(uint32_t)];
+
+    uint32_t networkEpoch = htonl(epoch);
+    uint32_t networkIp = htonl(client.realIp);
+    memcpy(input, &networkEpoch, sizeof(networkEpoch));
+    memcpy(input + sizeof(networkEpoch), &networkIp, sizeof(networkIp));
+
+    unsigned char mac[crypto_auth_hmacsha256_BYTES];
+    crypto_auth_hmacsha256(mac, input, sizeof(input), cookieSecret);
+
+    return Auth::Challenge(mac, mac + CHALLENGE_SIZE);
+}
+
+bool Server::checkCookie(const ClientData &client, const char *cookie)
+{
+    // cookies of the current and the previous period are accepted
+    uint32_t epoch = time(NULL) / COOKIE_LIFETIME;
+
+    for (int age = 0; age < 2; age++)
+    {
+        Auth::Challenge rightCookie = getCookie(client, epoch - age);
+        if (memcmp(&rightCookie[0], cookie, CHALLENGE_SIZE) == 0)
+            return true;
+    }
+
+    syslog(LOG_DEBUG, "invalid or expired cookie");
+    return false;
 }
 
 void Server::sendChallenge(ClientData *client)
@@ -113,10 +409,11 @@ void Server::sendChallenge(ClientData *client)
     syslog(LOG_DEBUG, "sending challenge to: %s\n",
            Utility::formatIp(client->realIp).c_str());
 
-    memcpy(echoSendPayloadBuffer(), &client->challenge[0], client->challenge.size());
-    sendEchoToClient(client, TunnelHeader::TYPE_CHALLENGE, client->challenge.size());
+    // the challenge is a cookie the server can check again without keeping it
+    Auth::Challenge cookie = getCookie(*client, time(NULL) / COOKIE_LIFETIME);
 
-    client->state = ClientData::STATE_CHALLENGE_SENT;
+    memcpy(echoSendPayloadBuffer(), &cookie[0], cookie.size());
+    sendEchoToClient(client, TunnelHeader::TYPE_CHALLENGE, cookie.size());
 }
 
 void Server::removeClient(ClientData *client)
@@ -127,33 +424,58 @@ void Server::removeClient(ClientData *client)
 
     releaseTunnelIp(client->tunnelIp);
 
+    for (int i = 0; i < client->routes.size(); i++)
+    {
+        const RouteTable::Prefix &prefix = client->routes[i];
+        if (routes.find(prefix) != client->tunnelIp)
+            continue;
+
+        routes.remove(prefix);
+        helper.removeRoute(prefix.network, prefix.length);
+    }
+
+    client->relay.closeAll();
+
     int nr = clientIDMap[client->ID];
 
     clientIDMap.erase(client->ID);
+    for (int i = 0; i < client->echoIds.size(); i++)
+        clientIDMap.erase(client->echoIds[i]);
     clientTunnelIpMap.erase(client->tunnelIp);
 
     clientList.erase(clientList.begin() + nr);
+
+    // the clients behind the erased one moved down by one
+    for (ClientIDMap::iterator it = clientIDMap.begin(); it != clientIDMap.end(); ++it)
+        if (it->second > nr)
+            it->second--;
+    for (ClientIpMap::iterator it = clientTunnelIpMap.begin(); it != clientTunnelIpMap.end(); ++it)
+        if (it->second > nr)
+            it->second--;
 }
 
-void Server::checkChallenge(ClientData *client, int length)
+void Server::sendConnectionAccept(ClientData *client)
 {
-    Auth::Response rightResponse = auth.getResponse(client->challenge);
-
-    if (length != sizeof(Auth::Response) ||
-            memcmp(&rightResponse, echoReceivePayloadBuffer(), length) != 0)
-    {
-        syslog(LOG_DEBUG, "wrong challenge response\n");
+    uint32_t *ip = (uint32_t *)echoSendPayloadBuffer();
+    *ip = htonl(client->tunnelIp);
 
-        sendEchoToClient(client, TunnelHeader::TYPE_CHALLENGE_ERROR, 0);
+    // lets the client skip the challenge when it reconnects
+    tickets.issue(echoSendPayloadBuffer() + sizeof(uint32_t), client->tunnelIp, client->ticketSession);
+    int length = sizeof(uint32_t) + TicketIssuer::SIZE;
 
-        removeClient(client);
-        return;
+    // the client tries udp in the background and switches if it gets through
+    if (udpPort != 0 || client->compactHeader)
+    {
+        uint16_t port = htons(udpPort);
+        memcpy(echoSendPayloadBuffer() + length, &port, sizeof(port));
+        length += sizeof(port);
     }
 
-    uint32_t *ip = (uint32_t *)echoSendPayloadBuffer();
-    *ip = htonl(client->tunnelIp);
+    // the version of the framing the client is to use, only sent to those offering one
+    if (client->compactHeader)
+        echoSendPayloadBuffer()[length++] = CompactHeader::VERSION;
 
-    sendEchoToClient(client, TunnelHeader::TYPE_CONNECTION_ACCEPT, sizeof(uint32_t));
+    sendEchoToClient(client, TunnelHeader::TYPE_CONNECTION_ACCEPT, length);
 
     client->state = ClientData::STATE_ESTABLISHED;
 
@@ -166,92 +488,145 @@ void Server::sendReset(ClientData *client)
     sendEchoToClient(client, TunnelHeader::TYPE_RESET_CONNECTION, 0);
 }
 
-bool Server::handleEchoData(char* data, int dataLength, uint32_t realIp,
-                            bool reply, uint16_t id, uint16_t seq,
-                            uint64_t &nonce, unsigned char *key)
+bool Server::handleEchoData(int dataLength, uint32_t realIp, bool reply,
+                            uint16_t id, uint16_t seq, const Echo::Route &route)
 {
     if (reply)
         return false;
 
-    if (dataLength < sizeof(TunnelHeader))
+    // compact echoes are read into the original layout, decrypted already
+    ClientData *client = getClientByID(id);
+    bool compact = client != NULL && client->compactHeader &&
+                   openCompactEcho(dataLength, false, client->session, Client::magic);
+
+    // answers to the client follow suit
+    if (compact)
+        client->session.compactHeader = true;
+
+    if (dataLength < sizeof(PacketCounter) + sizeof(TunnelHeader))
         return false;
 
-    unsigned char *ciphertext = (unsigned char *)data;
-    ClientData *client = getClientByID(id);
-    if (client == NULL) {
-        int completePacketLength = dataLength + sizeof(Echo::EchoHeader) + sizeof(Echo::IpHeader);
-        nonce = *(uint64_t*)&ciphertext[completePacketLength - sizeof(uint64_t)];
-        nonce = Utility::htonll(nonce);
-        key = new unsigned char[crypto_stream_salsa20_KEYBYTES];
-        memcpy(key, auth.getEncryptionKey(), auth.getEncryptionKeyLength());
-    } else {
-        client->nonce += seq - client->lastseq;
-        client->lastseq = seq;
-        nonce = client->nonce;
-        key = client->key;
-    }
-
-    ciphertext += sizeof(Echo::EchoHeader) + sizeof(Echo::IpHeader);
-    unsigned char oldpayload[dataLength];
-    memcpy(oldpayload, ciphertext, dataLength);
-    crypto_stream_salsa20_xor(ciphertext, ciphertext , dataLength,
-                              (const unsigned char *)&nonce, key);
-    dataLength -= sizeof(TunnelHeader);
-
-    TunnelHeader &header = *(TunnelHeader *)echo->receivePayloadBuffer();
-    DEBUG_ONLY(printf("received: type %d, length %d, id %d, seq %d\n",
-                      header->type, dataLength - sizeof(TunnelHeader), id, seq));
-
-     if (header.magic != Client::magic)
-     {
-         memcpy(ciphertext, oldpayload, dataLength + sizeof(TunnelHeader));
-         return false;
-     }
+    // decryption is done in place, keep the original in case this echo is
+    // not ours and has to be answered unchanged
+    char *data = echo->receivePayloadBuffer();
+    char originalData[dataLength];
+    if (!compact)
+        memcpy(originalData, data, dataLength);
 
-    if (client == NULL)
+    uint32_t counter = receivedCounter();
+    TunnelHeader &header = receivedHeader();
+
+    if (client != NULL && client->session.replayWindow.check(counter))
     {
-        // packet contains nonce in last 8 bytes which is no longer needed
-        dataLength -= sizeof(uint64_t);
-        handleUnknownClient(header, dataLength, realIp, id, seq, nonce, key);
-        delete key;
+        if (!compact)
+            decryptEcho(dataLength, false, client->session.nonce, client->session.key);
+
+        if (header.magic == Client::magic)
+        {
+            // a jump in the counter means echoes got lost on the way
+            if (client->session.replayWindow.update(counter) > 0)
+                client->fecEncoder.lossDetected(now);
+
+            dataLength -= sizeof(PacketCounter) + sizeof(TunnelHeader);
+            if (!decompressEcho(header, dataLength))
+                return true;
+
+            DEBUG_ONLY(printf("received: type %d, length %d, id %d, seq %d, counter %u\n",
+                              header.type, dataLength, id, seq, counter));
+
+            headerDecoder = client->headerCompression ? &client->headerDecoder : NULL;
+            sender = client;
+            bool handled = handleClientEcho(client, header, dataLength, realIp, id, seq, route);
+            headerDecoder = NULL;
+            sender = NULL;
+
+            return handled;
+        }
+
+        memcpy(data, originalData, dataLength);
+    }
+
+    // a connection request carries a fresh connection nonce in its last 8 bytes
+    if (dataLength < sizeof(PacketCounter) + sizeof(TunnelHeader) + sizeof(uint64_t))
+        return false;
+
+    dataLength -= sizeof(uint64_t);
+
+    Session session;
+    memcpy(&session.nonce, data + dataLength, sizeof(uint64_t));
+    session.nonce = Utility::htonll(session.nonce);
+    memcpy(session.key, auth.getEncryptionKey(), auth.getEncryptionKeyLength());
+
+    decryptEcho(dataLength, false, session.nonce, session.key);
+
+    if (header.magic != Client::magic || header.type != TunnelHeader::TYPE_CONNECTION_REQUEST)
+    {
+        memcpy(data, originalData, dataLength + sizeof(uint64_t));
+        return false;
+    }
+
+    session.replayWindow.update(counter);
+    dataLength -= sizeof(PacketCounter) + sizeof(TunnelHeader);
+
+    handleUnknownClient(header, dataLength, realIp, id, seq, route, session);
+    return true;
+}
+
+bool Server::handleClientEcho(ClientData *client, const TunnelHeader &header,
+                              int dataLength, uint32_t realIp, uint16_t id, uint16_t seq,
+                              const Echo::Route &route)
+{
+    // answered right away instead of waiting among the polls
+    if (header.type == TunnelHeader::TYPE_PROBE && client->state == ClientData::STATE_ESTABLISHED)
+    {
+        client->lastActivity = now;
+        sendEcho(magic, TunnelHeader::TYPE_PROBE, 0, realIp, true, id, seq, route, client->session);
         return true;
     }
 
-    pollReceived(client, id, seq);
+    pollReceived(client, realIp, id, seq, route);
 
     switch (header.type)
     {
-        case TunnelHeader::TYPE_CONNECTION_REQUEST:
-            if (client->state == ClientData::STATE_CHALLENGE_SENT)
+        case TunnelHeader::TYPE_DATA:
+            if (client->state == ClientData::STATE_ESTABLISHED)
             {
-                sendChallenge(client);
+                if (dataLength == 0)
+                {
+                    syslog(LOG_WARNING, "received empty data packet");
+                    return true;
+                }
+
+                sendToTun(dataLength);
                 return true;
             }
-
-            while (client->pollIds.size() > 1)
-                client->pollIds.pop();
-
-            syslog(LOG_DEBUG, "reconnecting %s", Utility::formatIp(realIp).c_str());
-            sendReset(client);
-            removeClient(client);
-            return true;
-        case TunnelHeader::TYPE_CHALLENGE_RESPONSE:
-            if (client->state == ClientData::STATE_CHALLENGE_SENT)
+            break;
+        case TunnelHeader::TYPE_FEC_DATA:
+        case TunnelHeader::TYPE_FEC_PARITY:
+            if (client->state == ClientData::STATE_ESTABLISHED)
             {
-                checkChallenge(client, dataLength);
+                handleFecData(client->fecDecoder, header.type, dataLength);
                 return true;
             }
             break;
-        case TunnelHeader::TYPE_DATA:
-            if (client->state == ClientData::STATE_ESTABLISHED)
+        case TunnelHeader::TYPE_ARQ_DATA:
+        case TunnelHeader::TYPE_ARQ_ACK:
+        case TunnelHeader::TYPE_ARQ_STREAM:
+            if (client->state == ClientData::STATE_ESTABLISHED && client->arqEnabled)
             {
-                if (dataLength == 0)
+                int length = client->arq.decode(echoReceivePayloadBuffer(), dataLength,
+                                                header.type != TunnelHeader::TYPE_ARQ_ACK, now);
+                if (length > 0 && header.type == TunnelHeader::TYPE_ARQ_STREAM)
                 {
-                    syslog(LOG_WARNING, "received empty data packet");
-                    return true;
+                    if (client->relaying)
+                        client->relay.receiveFrame(echoReceivePayloadBuffer(), length);
+                }
+                else if (length > 0)
+                {
+                    sendToTun(length);
                 }
 
-                sendToTun(dataLength);
+                serveArq(client);
                 return true;
             }
             break;
@@ -273,6 +648,26 @@ Server::ClientData *Server::getClientByTunnelIp(uint32_t ip)
     return &clientList[clientMapIterator->second];
 }
 
+Server::ClientData *Server::getClientByDestination(uint32_t ip)
+{
+    ClientData *client = getClientByTunnelIp(ip);
+    if (client != NULL || routes.size() == 0)
+        return client;
+
+    uint32_t tunnelIp = routes.lookup(ip);
+    return tunnelIp != 0 ? getClientByTunnelIp(tunnelIp) : NULL;
+}
+
+Server::ClientData *Server::getClientByRoute(const RouteTable::Prefix &prefix)
+{
+    for (int i = 0; i < clientList.size(); i++)
+        for (int j = 0; j < clientList[i].routes.size(); j++)
+            if (clientList[i].routes[j].overlaps(prefix))
+                return &clientList[i];
+
+    return NULL;
+}
+
 Server::ClientData *Server::getClientByID(uint16_t id)
 {
     ClientIDMap::iterator clientMapIterator = clientIDMap.find(id);
@@ -287,7 +682,7 @@ void Server::handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp)
     if (destIp == network + 255) // ignore broadcasts
         return;
 
-    ClientData *client = getClientByTunnelIp(destIp);
+    ClientData *client = getClientByDestination(destIp);
 
     if (client == NULL)
     {
@@ -295,14 +690,252 @@ void Server::handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp)
         return;
     }
 
+    clampMss(echoSendPayloadBuffer(), dataLength, client->mtu);
+
+    // the tunnel to this client is narrower than the device, the packet is
+    // split or its sender told, as a router would do
+    if (dataLength > client->mtu)
+    {
+        if (!fragmentPacket(client, dataLength))
+            reportMtu(client, dataLength);
+        return;
+    }
+
+    sendPacketToClient(client, dataLength);
+}
+
+bool Server::fragmentPacket(ClientData *client, int dataLength)
+{
+    char *packet = echoSendPayloadBuffer();
+    if (dataLength < 20 || ((uint8_t)packet[0] >> 4) != 4)
+        return true; // dropped, only ipv4 is tunneled
+
+    uint16_t fragment = ((uint8_t)packet[6] << 8) | (uint8_t)packet[7];
+    if (fragment & 0x4000 || (packet[0] & 0x0f) != 5) // don't fragment, or options that might have to be copied
+        return false;
+
+    vector<char> original(packet, packet + dataLength);
+    int step = (client->mtu - 20) & ~7;
+
+    for (int offset = 0; offset < dataLength - 20; offset += step)
+    {
+        int length = min(step, dataLength - 20 - offset);
+        bool last = offset + length == dataLength - 20;
+
+        memcpy(packet, &original[0], 20);
+        memcpy(packet + 20, &original[20 + offset], length);
+
+        uint16_t totalLength = htons(20 + length);
+        uint16_t fragmentField = htons((fragment & 0x2000) | (last ? 0 : 0x2000) | ((fragment & 0x1fff) + offset / 8));
+        memcpy(packet + 2, &totalLength, sizeof(totalLength));
+        memcpy(packet + 6, &fragmentField, sizeof(fragmentField));
+        memset(packet + 10, 0, 2);
+        uint16_t checksum = Utility::checksum(packet, 20);
+        memcpy(packet + 10, &checksum, sizeof(checksum));
+
+        sendPacketToClient(client, 20 + length);
+    }
+
+    fragmentedPackets++;
+    return true;
+}
+
+void Server::reportMtu(ClientData *client, int dataLength)
+{
+    const char *packet = echoSendPayloadBuffer();
+    int quoted = min(dataLength, ((uint8_t)packet[0] & 0x0f) * 4 + 8);
+
+    // icmp destination unreachable, fragmentation needed, as if from the client
+    char report[20 + 8 + 60 + 8];
+    memset(report, 0, 28);
+    report[0] = 0x45;
+    uint16_t totalLength = htons(28 + quoted);
+    memcpy(report + 2, &totalLength, sizeof(totalLength));
+    report[8] = 64;
+    report[9] = IPPROTO_ICMP;
+    uint32_t source = htonl(client->tunnelIp);
+    memcpy(report + 12, &source, sizeof(source));
+    memcpy(report + 16, packet + 12, sizeof(source));
+
+    report[20] = 3;
+    report[21] = 4;
+    uint16_t mtu = htons(client->mtu);
+    memcpy(report + 26, &mtu, sizeof(mtu));
+    memcpy(report + 28, packet, quoted);
+
+    uint16_t checksum = Utility::checksum(report + 20, 8 + quoted);
+    memcpy(report + 22, &checksum, sizeof(checksum));
+    checksum = Utility::checksum(report, 20);
+    memcpy(report + 10, &checksum, sizeof(checksum));
+
+    tun->write(report, 28 + quoted);
+    mtuReports++;
+}
+
+void Server::reportTimeExceeded(int dataLength)
+{
+    const char *packet = echoReceivePayloadBuffer();
+    int quoted = min(dataLength, ((uint8_t)packet[0] & 0x0f) * 4 + 8);
+
+    // icmp time exceeded in transit, from our end of the tunnel
+    char *report = echoSendPayloadBuffer();
+    memset(report, 0, 28);
+    report[0] = 0x45;
+    uint16_t totalLength = htons(28 + quoted);
+    memcpy(report + 2, &totalLength, sizeof(totalLength));
+    report[8] = 64;
+    report[9] = IPPROTO_ICMP;
+    uint32_t source = htonl(network + 1);
+    memcpy(report + 12, &source, sizeof(source));
+    memcpy(report + 16, packet + 12, sizeof(source));
+
+    report[20] = 11;
+    memcpy(report + 28, packet, quoted);
+
+    uint16_t checksum = Utility::checksum(report + 20, 8 + quoted);
+    memcpy(report + 22, &checksum, sizeof(checksum));
+    checksum = Utility::checksum(report, 20);
+    memcpy(report + 10, &checksum, sizeof(checksum));
+
+    uint32_t destIp;
+    memcpy(&destIp, packet + 12, sizeof(destIp));
+    handleTunData(28 + quoted, network + 1, ntohl(destIp));
+}
+
+void Server::sendPacketToClient(ClientData *client, int dataLength)
+{
+    if (client->headerCompression)
+        dataLength = client->headerEncoder.encode(echoSendPayloadBuffer(), dataLength);
+
+    if (client->arqEnabled)
+    {
+        dataLength = client->arq.encodeData(echoSendPayloadBuffer(), dataLength, TunnelHeader::TYPE_ARQ_DATA, now);
+        if (dataLength == 0)
+        {
+            client->droppedPackets++;
+            return;
+        }
+
+        sendEchoToClient(client, TunnelHeader::TYPE_ARQ_DATA, dataLength);
+        serveArq(client);
+        return;
+    }
+
+    if (client->fecEncoder.isActive(now))
+    {
+        dataLength = client->fecEncoder.encode(echoSendPayloadBuffer(), dataLength, now);
+        sendEchoToClient(client, TunnelHeader::TYPE_FEC_DATA, dataLength);
+
+        if (client->fecEncoder.groupComplete())
+            sendFecParity(client);
+        else
+            setTimeoutIfEarlier(FEC_FLUSH_DELAY);
+        return;
+    }
+
     sendEchoToClient(client, TunnelHeader::TYPE_DATA, dataLength);
 }
 
-void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
+bool Server::forwardPacket(int length)
+{
+    char *packet = echoReceivePayloadBuffer();
+    if (!hairpinning || sender == NULL || length < 20 || ((uint8_t)packet[0] >> 4) != 4)
+        return false;
+
+    uint32_t sourceIp, destIp;
+    memcpy(&sourceIp, packet + 12, sizeof(sourceIp));
+    memcpy(&destIp, packet + 16, sizeof(destIp));
+    sourceIp = ntohl(sourceIp);
+    destIp = ntohl(destIp);
+
+    if (getClientByDestination(destIp) == NULL)
+        return false;
+
+    // only from the addresses of the sender, others are left to the kernel
+    // and its reverse path filter
+    bool ownSource = sourceIp == sender->tunnelIp;
+    for (int i = 0; i < sender->routes.size() && !ownSource; i++)
+        ownSource = sender->routes[i].contains(RouteTable::Prefix(sourceIp, 32));
+    if (!ownSource)
+        return false;
+
+    // routed like the kernel would, without the trip through it
+    uint8_t ttl = packet[8];
+    if (ttl <= 1)
+    {
+        reportTimeExceeded(length);
+        return true;
+    }
+
+    packet[8] = ttl - 1;
+    Utility::updateChecksum(packet + 10, (ttl << 8) | (uint8_t)packet[9], ((ttl - 1) << 8) | (uint8_t)packet[9]);
+
+    memcpy(echoSendPayloadBuffer(), packet, length);
+    handleTunData(length, sourceIp, destIp);
+    hairpinned++;
+
+    return true;
+}
+
+void Server::sendFecParity(ClientData *client)
+{
+    int length = client->fecEncoder.writeParity(echoSendPayloadBuffer());
+    sendEchoToClient(client, TunnelHeader::TYPE_FEC_PARITY, length);
+}
+
+void Server::serveArq(ClientData *client)
+{
+    // without a poll retransmissions and acks wait, the next one serves them
+    int length, type;
+    while (client->pollIds.size() > 0 &&
+           (length = client->arq.retransmit(echoSendPayloadBuffer(), type, now)) > 0)
+        sendEchoToClient(client, type, length);
+
+    if (client->pollIds.size() > 0 && client->arq.ackDue(now))
+        sendEchoToClient(client, TunnelHeader::TYPE_POLL, 0);
+
+    Time deadline = client->arq.deadline();
+    if (deadline != Time::ZERO && now < deadline)
+        setTimeoutIfEarlier(deadline - now);
+}
+
+void Server::addStreamFds(fd_set &readFds, fd_set &writeFds, int &maxFd)
+{
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        if (client->relaying)
+            client->relay.addFds(readFds, writeFds, maxFd);
+}
+
+void Server::handleStreams(const fd_set &readFds, const fd_set &writeFds)
+{
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+    {
+        if (!client->relaying || client->state != ClientData::STATE_ESTABLISHED)
+            continue;
+
+        client->relay.handleFds(readFds, writeFds);
+
+        // like retransmissions the frames wait for polls instead of being queued
+        int length;
+        while (client->pollIds.size() > 0 && client->arq.canSend() &&
+               (length = client->relay.nextFrame(echoSendPayloadBuffer(), client->mtu)) > 0)
+        {
+            length = client->arq.encodeData(echoSendPayloadBuffer(), length, TunnelHeader::TYPE_ARQ_STREAM, now);
+            sendEchoToClient(&*client, TunnelHeader::TYPE_ARQ_STREAM, length);
+        }
+
+        Time deadline = client->arq.deadline();
+        if (deadline != Time::ZERO && now < deadline)
+            setTimeoutIfEarlier(deadline - now);
+    }
+}
+
+void Server::pollReceived(ClientData *client, uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
+                          const Echo::Route &route)
 {
     unsigned int maxSavedPolls = client->maxPolls != 0 ? client->maxPolls : 1;
 
-    client->pollIds.push(ClientData::EchoId(echoId, echoSeq));
+    client->pollIds.push(ClientData::EchoId(realIp, echoId, echoSeq, route, now));
     if (client->pollIds.size() > maxSavedPolls)
         client->pollIds.pop();
     DEBUG_ONLY(printf("poll -> %d\n", client->pollIds.size()));
@@ -318,16 +951,53 @@ void Server::pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq)
     }
 
     client->lastActivity = now;
+
+    if (!pollTimerArmed && client->maxPolls != 0 && client->pollIds.size() > 0)
+    {
+        pollTimerArmed = true;
+        setTimeoutIfEarlier(POLL_EXPIRY_MARGIN);
+    }
+}
+
+bool Server::expirePolls()
+{
+    bool pollsWaiting = false;
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+    {
+        if (client->state != ClientData::STATE_ESTABLISHED || client->maxPolls == 0)
+            continue;
+
+        // answer polls before the nat or firewall state for them is gone,
+        // so the client can replace them with fresh ones
+        while (client->pollIds.size() > 0 && !(now < client->pollIds.front().received + pollExpiry))
+        {
+            DEBUG_ONLY(printf("poll expired: seq %d\n", client->pollIds.front().seq));
+            client->expiredPolls++;
+            sendEchoToClient(&*client, TunnelHeader::TYPE_POLL, 0);
+        }
+
+        if (client->pollIds.size() > 0)
+            pollsWaiting = true;
+    }
+
+    return pollsWaiting;
 }
 
 void Server::sendEchoToClient(ClientData *client, int type, int dataLength)
 {
+    // with arq every echo without data acknowledges what has been received
+    if (type == TunnelHeader::TYPE_POLL && client->arqEnabled)
+    {
+        type = TunnelHeader::TYPE_ARQ_ACK;
+        dataLength = client->arq.encodeAck(echoSendPayloadBuffer());
+    }
+
     if (client->maxPolls == 0)
     {
-        client->nonce += 1;
-        sendEcho(magic, type, dataLength, client->realIp, true,
+        sendEcho(magic, type, dataLength, client->pollIds.front().realIp, true,
                  client->pollIds.front().id, client->pollIds.front().seq,
-                 client->nonce, client->key);
+                 client->pollIds.front().route, client->session);
         return;
     }
 
@@ -335,17 +1005,17 @@ void Server::sendEchoToClient(ClientData *client, int type, int dataLength)
     {
         ClientData::EchoId echoId = client->pollIds.front();
         client->pollIds.pop();
-        client->nonce += 1;
 
         DEBUG_ONLY(printf("sending -> %d\n", client->pollIds.size()));
-        sendEcho(magic, type, dataLength, client->realIp, true, echoId.id,
-                 echoId.seq, client->nonce, client->key);
+        sendEcho(magic, type, dataLength, echoId.realIp, true, echoId.id,
+                 echoId.seq, echoId.route, client->session);
         return;
     }
 
     if (client->pendingPackets.size() == MAX_BUFFERED_PACKETS)
     {
         client->pendingPackets.pop();
+        client->droppedPackets++;
         syslog(LOG_WARNING, "packet dropped to %s",
                Utility::formatIp(client->tunnelIp).c_str());
     }
@@ -356,7 +1026,7 @@ void Server::sendEchoToClient(ClientData *client, int type, int dataLength)
     Packet &packet = client->pendingPackets.back();
     packet.type = type;
     packet.data.resize(dataLength);
-    memcpy(&packet.data[0], echoReceivePayloadBuffer(), dataLength);
+    memcpy(&packet.data[0], echoSendPayloadBuffer(), dataLength);
 }
 
 void Server::releaseTunnelIp(uint32_t tunnelIp)
@@ -366,20 +1036,103 @@ void Server::releaseTunnelIp(uint32_t tunnelIp)
 
 void Server::handleTimeout()
 {
-    for (int i = 0; i < clientList.size(); i++)
+    if (!(now < nextKeepAliveCheck))
     {
-        ClientData *client = &clientList[i];
+        for (int i = 0; i < clientList.size(); i++)
+        {
+            ClientData *client = &clientList[i];
+
+            if (client->lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+            {
+                syslog(LOG_DEBUG, "client timeout: %s\n",
+                       Utility::formatIp(client->realIp).c_str());
+                removeClient(client);
+                i--;
+            }
+        }
 
-        if (client->lastActivity + KEEP_ALIVE_INTERVAL * 2 < now)
+        // a replayed request is refused by its proof or cookie after this anyway
+        time_t current = time(NULL);
+        map<uint64_t, time_t>::iterator seen = recentNonces.begin();
+        while (seen != recentNonces.end())
         {
-            syslog(LOG_DEBUG, "client timeout: %s\n",
-                   Utility::formatIp(client->realIp).c_str());
-            removeClient(client);
-            i--;
+            if (seen->second + 2 * PROOF_MAX_CLOCK_SKEW < current)
+                recentNonces.erase(seen++);
+            else
+                ++seen;
         }
+
+        nextKeepAliveCheck = now + KEEP_ALIVE_INTERVAL;
     }
 
-    setTimeout(KEEP_ALIVE_INTERVAL);
+    // while polls are waiting check them every POLL_EXPIRY_MARGIN
+    pollTimerArmed = expirePolls();
+    Time timeout = pollTimerArmed ? Time(POLL_EXPIRY_MARGIN) : nextKeepAliveCheck - now;
+
+    // send the parity of incomplete groups when traffic pauses
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+    {
+        if (!client->fecEncoder.groupPending())
+            continue;
+
+        if (!(now < client->fecEncoder.flushDeadline()))
+            sendFecParity(&*client);
+        else if (client->fecEncoder.flushDeadline() - now < timeout)
+            timeout = client->fecEncoder.flushDeadline() - now;
+    }
+
+    setTimeout(timeout);
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        if (client->state == ClientData::STATE_ESTABLISHED && client->arqEnabled)
+            serveArq(&*client);
+}
+
+void Server::logStatistics()
+{
+    Worker::logStatistics();
+
+    syslog(LOG_INFO, "%d clients", (int)clientList.size());
+
+    if (hairpinned != 0)
+        syslog(LOG_INFO, "%u packets forwarded between clients", hairpinned);
+
+    if (fragmentedPackets != 0 || mtuReports != 0)
+        syslog(LOG_INFO, "%u packets fragmented and %u too big reported for clients of smaller mtu",
+               fragmentedPackets, mtuReports);
+
+    if (routes.size() != 0)
+        syslog(LOG_INFO, "%d prefixes routed to clients", routes.size());
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        syslog(LOG_INFO, "client %s (%s): %d polls waiting, %d packets queued, %u polls expired, %u packets dropped, "
+               "%u fec parity frames sent, %u packets recovered",
+               Utility::formatIp(client->realIp).c_str(), Utility::formatIp(client->tunnelIp).c_str(),
+               (int)client->pollIds.size(), (int)client->pendingPackets.size(),
+               client->expiredPolls, client->droppedPackets,
+               client->fecEncoder.getParitySent(), client->fecDecoder.getRecovered());
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        if (client->arqEnabled)
+            syslog(LOG_INFO, "client %s arq: %d frames in flight, %u retransmitted, %u duplicates, %u window full",
+                   Utility::formatIp(client->tunnelIp).c_str(), client->arq.getInFlight(),
+                   client->arq.getRetransmitted(), client->arq.getDuplicates(),
+                   client->arq.getWindowFull());
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        if (client->headerCompression)
+            syslog(LOG_INFO, "client %s headers: %u compressed, %u sent in full, %u bytes saved, %u dropped",
+                   Utility::formatIp(client->tunnelIp).c_str(), client->headerEncoder.getCompressed(),
+                   client->headerEncoder.getFull(), client->headerEncoder.getSaved(),
+                   client->headerDecoder.getDropped());
+
+    for (ClientList::iterator client = clientList.begin(); client != clientList.end(); ++client)
+        if (client->relaying)
+            syslog(LOG_INFO, "client %s relay: %d connections, %u opened, %u reset, %llu kB sent, %llu kB received",
+                   Utility::formatIp(client->tunnelIp).c_str(), client->relay.getStreams(),
+                   client->relay.getOpened(), client->relay.getReset(),
+                   (unsigned long long)(client->relay.getBytesSent() / 1000),
+                   (unsigned long long)(client->relay.getBytesReceived() / 1000));
 }
 
 uint32_t Server::reserveTunnelIp(uint32_t desiredIp)
@@ -414,6 +1167,8 @@ uint32_t Server::reserveTunnelIp(uint32_t desiredIp)
 
 void Server::run()
 {
+    now = Time::now();
+    nextKeepAliveCheck = now + KEEP_ALIVE_INTERVAL;
     setTimeout(KEEP_ALIVE_INTERVAL);
 
     Worker::run();
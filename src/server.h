@@ -22,25 +22,54 @@
 
 #include "worker.h"
 #include "auth.h"
+#include "ticket.h"
+#include "relay.h"
+#include "routes.h"
+#include "filter.h"
+#include "helper.h"
 
 #include <map>
 #include <queue>
 #include <vector>
 #include <set>
+#include <time.h>
 
 class Server : public Worker
 {
 public:
     Server(int tunnelMtu, const char *deviceName, const char *passphrase,
-           uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout);
+           uint32_t network, bool answerEcho, uid_t uid, gid_t gid, int pollTimeout,
+           uint16_t udpPort, bool filterReplies, const std::vector<RouteTable::Prefix> &allowedRoutes);
     virtual ~Server();
 
+    void setHandshakeLimit(int limit) { handshakeLimit = limit; }
+    void setHairpinning(bool enabled) { hairpinning = enabled; }
+
     // change some time:
     // struct __attribute__ ((__packed__)) ClientConnectData
     struct ClientConnectData
     {
+        enum Flags
+        {
+            FLAG_ARQ = 1,
+            FLAG_TICKET = 2, // a resumption ticket follows
+            FLAG_PROOF = 4,  // an Auth::Proof over everything before it follows
+            FLAG_COOKIE = 8, // a challenge from the server and the response to it follow
+            FLAG_COMPRESSION = 16,
+            FLAG_HEADER_COMPRESSION = 32,
+            FLAG_STREAMS = 64, // tcp connections are relayed, needs arq
+            FLAG_VERSION_2 = 128 // the client speaks version 2: the compact framing, its mtu follows the routes
+        };
+
+        int length() const; // including the optional parts
+
         uint8_t maxPolls;
+        uint8_t flags;
+        uint8_t echoIds; // further echo ids of the client, they follow right after
+        uint8_t routes;  // prefixes routed to the client, ROUTE_SIZE bytes each after the echo ids
         uint32_t desiredIp;
+
+        static const int ROUTE_SIZE = 5; // network and prefix length
     };
 
     static const Worker::TunnelHeader::Magic magic;
@@ -57,19 +86,22 @@ protected:
         enum State
         {
             STATE_NEW,
-            STATE_CHALLENGE_SENT,
             STATE_ESTABLISHED
         };
 
         struct EchoId
         {
-            EchoId(uint16_t _id, uint16_t _seq) : id(_id), seq(_seq) {}
+            EchoId(uint32_t _realIp, uint16_t _id, uint16_t _seq, const Echo::Route &_route, Time _received)
+                : realIp(_realIp), id(_id), seq(_seq), route(_route), received(_received) {}
 
+            uint32_t realIp; // a client with several uplinks uses several
             uint16_t id;
             uint16_t seq;
+            Echo::Route route; // polls are answered the way they came
+            Time received;
         };
 
-        uint32_t realIp;
+        uint32_t realIp; // the connection came from
         uint32_t tunnelIp;
 
         std::queue<Packet> pendingPackets;
@@ -77,56 +109,121 @@ protected:
         int maxPolls;
         std::queue<EchoId> pollIds;
         Time lastActivity;
+        unsigned int expiredPolls;
+        unsigned int droppedPackets;
+
+        Fec::Encoder fecEncoder;
+        Fec::Decoder fecDecoder;
+
+        bool arqEnabled;
+        Arq arq;
+
+        bool headerCompression;
+        HeaderCompression::Encoder headerEncoder;
+        HeaderCompression::Decoder headerDecoder;
+
+        bool relaying;
+        StreamRelay relay;
+
+        // offered by the client, the session switches with its first compact echo
+        bool compactHeader;
+
+        int mtu; // of the tunnel to the client, at most ours
 
         State state;
 
-        Auth::Challenge challenge;
-        uint64_t nonce; // we use 8byte nounce
-        unsigned char key[crypto_stream_salsa20_KEYBYTES];
-        uint16_t lastseq;
+        Session session;
+        uint32_t ticketSession; // carried by the tickets of the client, kept when it resumes
         uint16_t ID;
+        std::vector<uint16_t> echoIds; // further ids mapped to this client
+        std::vector<RouteTable::Prefix> routes;
     };
 
     typedef std::vector<ClientData> ClientList;
     typedef std::map<uint32_t, int> ClientIpMap;
     typedef std::map<uint16_t, int> ClientIDMap;
 
-    virtual bool handleEchoData(char* data, int dataLength, uint32_t realIp,
-                                bool reply, uint16_t id, uint16_t seq,
-                                uint64_t& nonce, unsigned char* key);
+    virtual bool handleEchoData(int dataLength, uint32_t realIp, bool reply,
+                                uint16_t id, uint16_t seq, const Echo::Route &route);
     virtual void handleTunData(int dataLength, uint32_t sourceIp, uint32_t destIp);
     virtual void handleTimeout();
+    virtual void logStatistics();
+    virtual bool forwardPacket(int length);
+    virtual void addStreamFds(fd_set &readFds, fd_set &writeFds, int &maxFd);
+    virtual void handleStreams(const fd_set &readFds, const fd_set &writeFds);
 
     virtual void run();
 
     void serveTun(ClientData *client);
 
+    bool handleClientEcho(ClientData *client, const TunnelHeader &header,
+                          int dataLength, uint32_t realIp, uint16_t id, uint16_t seq,
+                          const Echo::Route &route);
     void handleUnknownClient(const TunnelHeader &header, int dataLength,
                              uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
-                             const uint64_t &nonce, const unsigned char *key);
+                             const Echo::Route &route, const Session &session);
     void removeClient(ClientData *client);
 
     void sendChallenge(ClientData *client);
-    void checkChallenge(ClientData *client, int dataLength);
+    void sendConnectionAccept(ClientData *client);
+    bool handshakeAllowed(uint32_t realIp);
+    bool checkProof(const ClientData &client, const Auth::Proof &proof, int length);
+    Auth::Challenge getCookie(const ClientData &client, uint32_t epoch);
+    bool checkCookie(const ClientData &client, const char *cookie);
+    void addClient(const ClientData &client);
     void sendReset(ClientData *client);
 
     void sendEchoToClient(ClientData *client, int type, int dataLength);
+    void sendPacketToClient(ClientData *client, int dataLength); // from echoSendPayloadBuffer
+    bool fragmentPacket(ClientData *client, int dataLength); // false if it must not be
+    void reportMtu(ClientData *client, int dataLength);      // to the sender, through the tunnel device
+    void reportTimeExceeded(int dataLength);                 // to the sending client, of the received packet
+    void sendFecParity(ClientData *client);
+    void serveArq(ClientData *client);
 
-    void pollReceived(ClientData *client, uint16_t echoId, uint16_t echoSeq);
+    void pollReceived(ClientData *client, uint32_t realIp, uint16_t echoId, uint16_t echoSeq,
+                      const Echo::Route &route);
+    bool expirePolls();
 
     uint32_t reserveTunnelIp(uint32_t desiredIp);
     void releaseTunnelIp(uint32_t tunnelIp);
 
     ClientData *getClientByTunnelIp(uint32_t ip);
+    ClientData *getClientByDestination(uint32_t ip); // by tunnel ip or routed prefix
+    ClientData *getClientByRoute(const RouteTable::Prefix &prefix); // routed a prefix overlapping it
     ClientData *getClientByID(uint16_t id);
 
     Auth auth;
+    TicketIssuer tickets;
+    std::map<uint64_t, time_t> recentNonces; // of accepted connection requests
+
+    unsigned char cookieSecret[crypto_auth_hmacsha256_KEYBYTES];
+
+    int handshakeLimit; // connection requests per second and source, 0 for no limit
+    time_t handshakeSecond;
+    std::map<uint32_t, int> handshakeCounts;
+
+    uint16_t udpPort; // offered to clients, 0 without udp
+
+    bool hairpinning; // packets between clients are forwarded without the tunnel device
+    ClientData *sender; // of the echo being handled, packets from it may be forwarded
+    unsigned int hairpinned;
+    unsigned int fragmentedPackets;
+    unsigned int mtuReports;
 
     uint32_t network;
+    RouteTable routes; // prefixes behind clients, to their tunnel ips
+    std::vector<RouteTable::Prefix> allowedRoutes; // those of clients must lie within these
+    PrivilegedHelper helper; // started if there are routes or a reply filter
+
+    ReplyFilter replyFilter;
     std::set<uint32_t> usedIps;
     uint32_t latestAssignedIpOffset;
 
     Time pollTimeout;
+    Time pollExpiry;
+    bool pollTimerArmed;
+    Time nextKeepAliveCheck;
 
     ClientList clientList;
     ClientIDMap clientIDMap;
@@ -0,0 +1,77 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ticket.h"
+#include "utility.h"
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+TicketIssuer::TicketIssuer()
+{
+    Utility::randomBytes((char *)key, sizeof(key));
+    Utility::randomBytes((char *)nonce, sizeof(nonce));
+    issued = 0;
+    sessions = 0;
+}
+
+void TicketIssuer::issue(char *ticket, uint32_t tunnelIp, uint32_t session)
+{
+    issued++;
+    uint64_t counter = Utility::htonll(issued);
+    memcpy(nonce + sizeof(nonce) - sizeof(counter), &counter, sizeof(counter));
+
+    unsigned char plain[crypto_secretbox_ZEROBYTES + sizeof(Contents)];
+    memset(plain, 0, crypto_secretbox_ZEROBYTES);
+
+    Contents *contents = (Contents *)(plain + crypto_secretbox_ZEROBYTES);
+    contents->tunnelIp = htonl(tunnelIp);
+    contents->session = htonl(session);
+    contents->expires = htonl(time(NULL) + TICKET_LIFETIME);
+
+    unsigned char sealed[sizeof(plain)];
+    crypto_secretbox(sealed, plain, sizeof(plain), nonce, key);
+
+    // the leading zero bytes of the box are not sent
+    memcpy(ticket, nonce, sizeof(nonce));
+    memcpy(ticket + sizeof(nonce), sealed + crypto_secretbox_BOXZEROBYTES,
+           sizeof(sealed) - crypto_secretbox_BOXZEROBYTES);
+}
+
+bool TicketIssuer::open(const char *ticket, uint32_t &tunnelIp, uint32_t &session) const
+{
+    unsigned char sealed[crypto_secretbox_ZEROBYTES + sizeof(Contents)];
+    memset(sealed, 0, crypto_secretbox_BOXZEROBYTES);
+    memcpy(sealed + crypto_secretbox_BOXZEROBYTES, ticket + sizeof(nonce),
+           sizeof(sealed) - crypto_secretbox_BOXZEROBYTES);
+
+    unsigned char plain[sizeof(sealed)];
+    if (crypto_secretbox_open(plain, sealed, sizeof(sealed), (const unsigned char *)ticket, key) != 0)
+        return false;
+
+    Contents *contents = (Contents *)(plain + crypto_secretbox_ZEROBYTES);
+    if (ntohl(contents->expires) < (uint32_t)time(NULL))
+        return false;
+
+    tunnelIp = ntohl(contents->tunnelIp);
+    session = ntohl(contents->session);
+    return true;
+}
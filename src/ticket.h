@@ -0,0 +1,57 @@
+/*
+ *  Hans - IP over ICMP
+ *  Copyright (C) 2009 Friedrich Schöller <hans@schoeller.se>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <stdint.h>
+#include <nacl/crypto_secretbox.h>
+
+// resumption tickets sealed with a key only the server knows. a client
+// presenting a valid one gets its tunnel ip back without a new challenge.
+// the key is chosen at startup, so tickets do not survive a restart.
+// tickets are bound to a session, a resumed one keeps the id of the first.
+class TicketIssuer
+{
+public:
+    struct Contents
+    {
+        uint32_t tunnelIp;
+        uint32_t session;
+        uint32_t expires;
+    }; // size = 12
+
+    static const int SIZE = crypto_secretbox_NONCEBYTES + crypto_secretbox_ZEROBYTES -
+                            crypto_secretbox_BOXZEROBYTES + sizeof(Contents);
+
+    TicketIssuer();
+
+    uint32_t newSession() { return ++sessions; }
+
+    void issue(char *ticket, uint32_t tunnelIp, uint32_t session);
+    bool open(const char *ticket, uint32_t &tunnelIp, uint32_t &session) const;
+
+protected:
+    unsigned char key[crypto_secretbox_KEYBYTES];
+    unsigned char nonce[crypto_secretbox_NONCEBYTES]; // random prefix, counter at the end
+    uint64_t issued;
+    uint32_t sessions;
+};
+
+#endif
@@ -29,6 +29,7 @@ public:
     Time(int ms);
 
     timeval &getTimeval() { return tv; }
+    int milliseconds() const { return tv.tv_sec * 1000 + tv.tv_usec / 1000; }
 
     Time operator+(const Time &other) const;
     Time operator-(const Time &other) const;
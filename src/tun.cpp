@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/select.h>
 
 typedef ip IpHeader;
 
@@ -94,6 +95,38 @@ void Tun::write(const char *buffer, int length)
         syslog(LOG_ERR, "error writing %d bytes to tun: %s", length, tun_last_error());
 }
 
+void Tun::addRoute(uint32_t network, int length)
+{
+    char cmdline[512];
+    string networks = Utility::formatIp(network);
+
+#ifdef LINUX
+    string netmask = Utility::formatIp(length == 0 ? 0 : 0xffffffff << (32 - length));
+    snprintf(cmdline, sizeof(cmdline), "/sbin/route add -net %s netmask %s dev %s", networks.c_str(), netmask.c_str(), device);
+#else
+    snprintf(cmdline, sizeof(cmdline), "/sbin/route add -net %s/%d -interface %s", networks.c_str(), length, device);
+#endif
+
+    if (system(cmdline) != 0)
+        syslog(LOG_ERR, "could not add route");
+}
+
+void Tun::removeRoute(uint32_t network, int length)
+{
+    char cmdline[512];
+    string networks = Utility::formatIp(network);
+
+#ifdef LINUX
+    string netmask = Utility::formatIp(length == 0 ? 0 : 0xffffffff << (32 - length));
+    snprintf(cmdline, sizeof(cmdline), "/sbin/route del -net %s netmask %s dev %s", networks.c_str(), netmask.c_str(), device);
+#else
+    snprintf(cmdline, sizeof(cmdline), "/sbin/route delete -net %s/%d -interface %s", networks.c_str(), length, device);
+#endif
+
+    if (system(cmdline) != 0)
+        syslog(LOG_ERR, "could not remove route");
+}
+
 int Tun::read(char *buffer)
 {
     int length = tun_read(fd, buffer, mtu);
@@ -102,6 +135,19 @@ int Tun::read(char *buffer)
     return length;
 }
 
+bool Tun::hasData()
+{
+    fd_set fs;
+    FD_ZERO(&fs);
+    FD_SET(fd, &fs);
+
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+
+    return select(fd + 1, &fs, NULL, NULL, &timeout) > 0;
+}
+
 int Tun::read(char *buffer, uint32_t &sourceIp, uint32_t &destIp)
 {
     int length = read(buffer);
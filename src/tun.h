@@ -32,13 +32,17 @@ public:
     ~Tun();
 
     int getFd() { return fd; }
+    const char *getDevice() { return device; }
 
     int read(char *buffer);
     int read(char *buffer, uint32_t &sourceIp, uint32_t &destIp);
+    bool hasData(); // a read would not block
 
     void write(const char *buffer, int length);
 
     void setIp(uint32_t ip, uint32_t destIp, bool includeSubnet);
+    void addRoute(uint32_t network, int length);
+    void removeRoute(uint32_t network, int length);
 protected:
     char device[VTUN_DEV_LEN];
 
@@ -18,6 +18,7 @@
  */
 
 #include "utility.h"
+#include "exception.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -49,6 +50,15 @@ uint32_t Utility::rand()
     return ::rand();
 }
 
+void Utility::randomBytes(char *buffer, int length)
+{
+    ifstream urandom("/dev/urandom", ios::in | ios::binary);
+    urandom.read(buffer, length);
+
+    if (!urandom)
+        throw Exception("could not read /dev/urandom");
+}
+
 uint64_t Utility::htonll(const uint64_t &value) {
     int num = 42;
     if (*(char *)&num == 42) {
@@ -60,6 +70,33 @@ uint64_t Utility::htonll(const uint64_t &value) {
     }
 }
 
+uint16_t Utility::checksum(const char *data, int length)
+{
+    uint16_t *data16 = (uint16_t *)data;
+    uint32_t sum = 0;
+
+    for (sum = 0; length > 1; length -= 2)
+        sum += *data16++;
+    if (length == 1)
+        sum += *(unsigned char *)data16;
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+void Utility::updateChecksum(char *checksum, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum = (uint16_t)~(((uint8_t)checksum[0] << 8) | (uint8_t)checksum[1]);
+    sum += (uint16_t)~oldWord;
+    sum += newWord;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    checksum[0] = ~sum >> 8;
+    checksum[1] = ~sum;
+}
+
 
 /*
     uint32_t randombytes;
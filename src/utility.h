@@ -28,7 +28,14 @@ class Utility
 public:
     static std::string formatIp(const uint32_t& ip);
     static uint32_t rand();
+    static void randomBytes(char *buffer, int length);
     static uint64_t htonll(const uint64_t &value);
+
+    // internet checksum as in rfc 1071, in the byte order of the data
+    static uint16_t checksum(const char *data, int length);
+
+    // of an internet checksum when one 16 bit word it covers changes, as in rfc 1624
+    static void updateChecksum(char *checksum, uint16_t oldWord, uint16_t newWord);
 };
 
 #endif
@@ -21,12 +21,15 @@
 #include "tun.h"
 #include "exception.h"
 #include "config.h"
+#include "utility.h"
 
 #include <string.h>
+#include <errno.h>
 #include <syslog.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <arpa/inet.h>
 
 using namespace std;
 
@@ -53,13 +56,22 @@ Worker::Worker(int tunnelMtu, const char *deviceName, bool answerEcho, uid_t uid
     this->uid = uid;
     this->gid = gid;
     this->privilegesDropped = false;
+    this->statisticsRequested = 0;
+    this->delayedEchoes = 0;
+    this->fecGroupSize = 0;
+    this->headerDecoder = NULL;
+    this->mssClamping = true;
+    this->mssClamped = 0;
+    this->fecAutomatic = false;
+    this->droppedEchoes = 0;
+    this->reservedRoom = 0;
 
     echo = NULL;
     tun = NULL;
 
     try
     {
-        echo = new Echo(tunnelMtu + sizeof(TunnelHeader));
+        echo = new Echo(tunnelMtu + headerSize() + frameOverhead() + Echo::udpHeaderSize() - Echo::headerSize());
         tun = new Tun(deviceName, tunnelMtu);
     }
     catch (...)
@@ -77,96 +89,450 @@ Worker::~Worker()
     delete tun;
 }
 
-void Worker::sendEcho(const TunnelHeader::Magic &magic, int type, int length,
+void Worker::crypt(char *data, int length, const uint64_t &nonce, uint32_t counter,
+                   bool reply, const unsigned char *key)
+{
+    // both directions share the key, so they must never share a nonce
+    uint64_t packetNonce = nonce + counter;
+    if (reply)
+        packetNonce ^= (uint64_t)1 << 63;
+    packetNonce = Utility::htonll(packetNonce);
+
+    crypto_stream_salsa20_xor((unsigned char *)data, (unsigned char *)data, length,
+                              (const unsigned char *)&packetNonce, key);
+}
+
+bool Worker::sendEcho(const TunnelHeader::Magic &magic, int type, int length,
                       uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
-                      const uint64_t &nonce, const unsigned char *key)
+                      const Echo::Route &route, Session &session)
 {
     if (length > payloadBufferSize())
         throw Exception("packet too big");
 
-    TunnelHeader *header = (TunnelHeader *)echo->sendPayloadBuffer();
-    header->magic = magic;
-    header->type = type;
+    if (session.sendCounter == MAX_PACKET_COUNTER)
+    {
+        syslog(LOG_WARNING, "packet counter exhausted, echo dropped");
+        return false;
+    }
+
+    uint32_t counter = session.sendCounter++;
+    char *frame = echo->sendPayloadBuffer();
+    uint8_t flags = 0;
+
+    // only tunneled packets, the handshake is read before anything is agreed on
+    if (session.compression && (type == TunnelHeader::TYPE_DATA || type == TunnelHeader::TYPE_FEC_DATA ||
+                                type == TunnelHeader::TYPE_FEC_PARITY || type == TunnelHeader::TYPE_ARQ_DATA ||
+                                type == TunnelHeader::TYPE_ARQ_STREAM))
+    {
+        int compressedLength = compressor.compress(echoSendPayloadBuffer(), length);
+        if (compressedLength != 0)
+        {
+            length = compressedLength;
+            flags |= TunnelHeader::FLAG_COMPRESSED;
+        }
+    }
+
+    DEBUG_ONLY(printf("sending: type %d, length %d, id %d, seq %d, counter %u\n", type, length, id, seq, counter));
+
+    int frameLength;
+    if (session.compactHeader)
+    {
+        // the payload moves down into the room the shorter header leaves
+        memmove(frame + sizeof(CompactHeader), echoSendPayloadBuffer(), length);
+
+        CompactHeader *header = (CompactHeader *)frame;
+        header->counter[0] = counter >> 16;
+        header->counter[1] = counter >> 8;
+        header->counter[2] = counter;
+        memcpy(header->check, magic.data, sizeof(header->check));
+        header->type = type | flags;
+
+        frameLength = sizeof(CompactHeader) + length;
+        crypt(header->check, frameLength - sizeof(header->counter), session.nonce, counter, reply, session.key);
+    }
+    else
+    {
+        *(PacketCounter *)frame = htonl(counter);
+
+        TunnelHeader *header = (TunnelHeader *)(frame + sizeof(PacketCounter));
+        header->magic = magic;
+        header->type = type | flags;
 
-    DEBUG_ONLY(printf("sending: type %d, length %d, id %d, seq %d", type, length, id, seq));
+        frameLength = sizeof(PacketCounter) + sizeof(TunnelHeader) + length;
+        crypt(frame + sizeof(PacketCounter), frameLength - sizeof(PacketCounter),
+              session.nonce, counter, reply, session.key);
+    }
 
+    // the server learns the nonce of a new connection from its first echo
     if (type == TunnelHeader::TYPE_CONNECTION_REQUEST)
-        echo->setConnectionRequest();
+    {
+        uint64_t nonce = Utility::htonll(session.nonce);
+        memcpy(frame + frameLength, &nonce, sizeof(nonce));
+        frameLength += sizeof(nonce);
+    }
 
-    echo->send(length + sizeof(TunnelHeader), realIp, reply, id, seq, nonce, key);
+    if (pacer.isEnabled() && (sendQueue.size() > 0 || !pacer.consume(now)))
+    {
+        queueEcho(frameLength, realIp, reply, id, seq, route);
+        return true;
+    }
+
+    return echo->send(frameLength, realIp, reply, id, seq, route);
+}
+
+uint32_t Worker::receivedCounter()
+{
+    return ntohl(*(PacketCounter *)echo->receivePayloadBuffer());
+}
+
+void Worker::decryptEcho(int dataLength, bool reply, const uint64_t &nonce,
+                         const unsigned char *key)
+{
+    crypt(echo->receivePayloadBuffer() + sizeof(PacketCounter), dataLength - sizeof(PacketCounter),
+          nonce, receivedCounter(), reply, key);
+}
+
+bool Worker::openCompactEcho(int &dataLength, bool reply, Session &session,
+                             const TunnelHeader::Magic &magic)
+{
+    if (dataLength < sizeof(CompactHeader) || dataLength - sizeof(CompactHeader) > payloadBufferSize())
+        return false;
+
+    char *frame = echo->receivePayloadBuffer();
+    CompactHeader *header = (CompactHeader *)frame;
+
+    uint32_t counter = session.replayWindow.expand(header->counter[0] << 16 | header->counter[1] << 8 |
+                                                   header->counter[2], sizeof(header->counter) * 8);
+    if (!session.replayWindow.check(counter))
+        return false;
+
+    int encryptedLength = dataLength - sizeof(header->counter);
+    crypt(header->check, encryptedLength, session.nonce, counter, reply, session.key);
+
+    // decrypting again restores the echo if it is not ours
+    uint8_t type = header->type & ~(TunnelHeader::FLAG_COMPRESSED | TunnelHeader::FLAG_FIELDS);
+    if (memcmp(header->check, magic.data, sizeof(header->check)) != 0 ||
+        type == 0 || type > TunnelHeader::TYPE_ARQ_STREAM)
+    {
+        crypt(header->check, encryptedLength, session.nonce, counter, reply, session.key);
+        return false;
+    }
+
+    int offset = sizeof(CompactHeader);
+    if (header->type & TunnelHeader::FLAG_FIELDS)
+    {
+        uint32_t fieldsLength = 0;
+        for (int shift = 0; offset < dataLength && shift < 32; shift += 7)
+        {
+            uint8_t byte = frame[offset++];
+            fieldsLength |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+
+        if (fieldsLength > dataLength - offset)
+        {
+            syslog(LOG_DEBUG, "invalid compact header");
+            crypt(header->check, encryptedLength, session.nonce, counter, reply, session.key);
+            return false;
+        }
+        offset += fieldsLength;
+    }
+
+    // rewritten into the original layout, everything after reads only that
+    int length = dataLength - offset;
+    uint8_t typeFlags = header->type & ~TunnelHeader::FLAG_FIELDS;
+
+    memmove(frame + sizeof(PacketCounter) + sizeof(TunnelHeader), frame + offset, length);
+    *(PacketCounter *)frame = htonl(counter);
+    receivedHeader().magic = magic;
+    receivedHeader().type = typeFlags;
+
+    dataLength = sizeof(PacketCounter) + sizeof(TunnelHeader) + length;
+    return true;
+}
+
+bool Worker::decompressEcho(TunnelHeader &header, int &dataLength)
+{
+    if (!(header.type & TunnelHeader::FLAG_COMPRESSED))
+        return true;
+
+    header.type &= ~TunnelHeader::FLAG_COMPRESSED;
+
+    int length = compressor.decompress(echoReceivePayloadBuffer(), dataLength, payloadBufferSize());
+    if (length == -1)
+    {
+        syslog(LOG_DEBUG, "invalid compressed echo");
+        return false;
+    }
+
+    dataLength = length;
+    return true;
+}
+
+void Worker::queueEcho(int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                       const Echo::Route &route)
+{
+    pacer.setLimited();
+
+    if (sendQueue.size() >= MAX_PACED_ECHOES)
+    {
+        syslog(LOG_DEBUG, "pacing queue full, echo dropped");
+        droppedEchoes++;
+        return;
+    }
+
+    sendQueue.push_back(QueuedEcho());
+    QueuedEcho &queued = sendQueue.back();
+
+    queued.data.assign(echo->sendPayloadBuffer(), echo->sendPayloadBuffer() + length);
+    queued.realIp = realIp;
+    queued.reply = reply;
+    queued.id = id;
+    queued.seq = seq;
+    queued.route = route;
+
+    delayedEchoes++;
+}
+
+void Worker::flushSendQueue()
+{
+    while (sendQueue.size() > 0 && pacer.consume(now))
+    {
+        QueuedEcho &queued = sendQueue.front();
+
+        memcpy(echo->sendPayloadBuffer(), &queued.data[0], queued.data.size());
+        echo->send(queued.data.size(), queued.realIp, queued.reply, queued.id, queued.seq,
+                   queued.route);
+
+        sendQueue.pop_front();
+    }
 }
 
 void Worker::sendToTun(int length)
 {
+    length = decodeHeaders(length);
+    if (length == 0 || forwardPacket(length))
+        return;
+
     tun->write(echoReceivePayloadBuffer(), length);
 }
 
+int Worker::decodeHeaders(int length)
+{
+    if (headerDecoder == NULL)
+        return length;
+
+    return headerDecoder->decode(echoReceivePayloadBuffer(), length, tunnelMtu);
+}
+
+void Worker::clampMss(char *packet, int length, int mtu)
+{
+    if (!mssClamping || length < 20 || ((uint8_t)packet[0] >> 4) != 4 || packet[9] != IPPROTO_TCP)
+        return;
+
+    uint16_t fragment;
+    memcpy(&fragment, packet + 6, sizeof(fragment));
+    if (ntohs(fragment) & 0x1fff)
+        return;
+
+    int ipHeaderSize = (packet[0] & 0x0f) * 4;
+    if (length < ipHeaderSize + 20)
+        return;
+
+    char *tcp = packet + ipHeaderSize;
+    int tcpHeaderSize = ((uint8_t)tcp[12] >> 4) * 4;
+    if (!(tcp[13] & 0x02) || ipHeaderSize + tcpHeaderSize > length) // syn
+        return;
+
+    uint16_t maxMss = mtu - 40;
+
+    for (int i = 20; i < tcpHeaderSize; )
+    {
+        if (tcp[i] == 0) // end of options
+            break;
+        if (tcp[i] == 1) // no operation
+        {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= tcpHeaderSize)
+            break;
+
+        int optionSize = (uint8_t)tcp[i + 1];
+        if (optionSize < 2 || i + optionSize > tcpHeaderSize)
+            break;
+
+        if (tcp[i] == 2 && optionSize == 4)
+        {
+            uint16_t mss = ((uint8_t)tcp[i + 2] << 8) | (uint8_t)tcp[i + 3];
+            if (mss <= maxMss)
+                return;
+
+            tcp[i + 2] = maxMss >> 8;
+            tcp[i + 3] = maxMss;
+
+            // the option may start at an odd offset
+            if ((i + 2) % 2)
+                Utility::updateChecksum(tcp + 16, (mss >> 8) | (mss << 8), (maxMss >> 8) | (maxMss << 8));
+            else
+                Utility::updateChecksum(tcp + 16, mss, maxMss);
+
+            mssClamped++;
+            return;
+        }
+
+        i += optionSize;
+    }
+}
+
+void Worker::handleFecData(Fec::Decoder &decoder, int type, int dataLength)
+{
+    if (type == TunnelHeader::TYPE_FEC_DATA)
+    {
+        int length = decoder.receiveData(echoReceivePayloadBuffer(), dataLength);
+        if (length > 0)
+            deliverData(length);
+    }
+    else
+    {
+        decoder.receiveParity(echoReceivePayloadBuffer(), dataLength);
+    }
+
+    int length = decoder.recover(echoReceivePayloadBuffer());
+    if (length > 0)
+    {
+        DEBUG_ONLY(printf("recovered packet: %d bytes\n", length));
+        sendToTun(length);
+    }
+}
+
 void Worker::setTimeout(Time delta)
 {
     nextTimeout = now + delta;
 }
 
+void Worker::setTimeoutIfEarlier(Time delta)
+{
+    if (nextTimeout == Time::ZERO || now + delta < nextTimeout)
+        nextTimeout = now + delta;
+}
+
 void Worker::run()
 {
     now = Time::now();
     alive = true;
 
-    int maxFd = echo->getFd() > tun->getFd() ? echo->getFd() : tun->getFd();
-
     while (alive)
     {
-        fd_set fs;
+        fd_set fs, ws;
         Time timeout;
 
         FD_ZERO(&fs);
+        FD_ZERO(&ws);
         FD_SET(tun->getFd(), &fs);
-        FD_SET(echo->getFd(), &fs);
+        int maxFd = tun->getFd();
+
+        // the udp sockets may be opened while running
+        for (int socket = 0; socket < echo->socketCount(); socket++)
+        {
+            FD_SET(echo->getFd(socket), &fs);
+            if (echo->getFd(socket) > maxFd)
+                maxFd = echo->getFd(socket);
+
+            if (echo->getUdpFd(socket) != -1)
+            {
+                FD_SET(echo->getUdpFd(socket), &fs);
+                if (echo->getUdpFd(socket) > maxFd)
+                    maxFd = echo->getUdpFd(socket);
+            }
+        }
 
-        if (nextTimeout != Time::ZERO)
+        addStreamFds(fs, ws, maxFd);
+
+        // wake up for the next timeout or when the pacer allows the next echo
+        Time deadline = nextTimeout;
+        if (sendQueue.size() > 0)
         {
-            timeout = nextTimeout - now;
+            Time nextSend = pacer.nextToken(now);
+            if (deadline == Time::ZERO || nextSend < deadline)
+                deadline = nextSend;
+        }
+
+        if (deadline != Time::ZERO)
+        {
+            timeout = deadline - now;
             if (timeout < Time::ZERO)
                 timeout = Time::ZERO;
         }
 
         // wait for data or timeout
-        int result = select(maxFd + 1 , &fs, NULL, NULL, nextTimeout != Time::ZERO ? &timeout.getTimeval() : NULL);
+        int result = select(maxFd + 1 , &fs, &ws, NULL, deadline != Time::ZERO ? &timeout.getTimeval() : NULL);
         if (result == -1)
         {
-            if (alive)
-                throw Exception("select", true);
-            else
+            if (!alive)
                 return;
+            if (errno != EINTR)
+                throw Exception("select", true);
         }
         now = Time::now();
 
-        // timeout
-        if (result == 0)
+        if (statisticsRequested)
+        {
+            statisticsRequested = 0;
+            logStatistics();
+        }
+
+        if (result == -1)
+            continue;
+
+        flushSendQueue();
+
+        // timeout, also checked under load when select never times out
+        if (nextTimeout != Time::ZERO && !(now < nextTimeout))
         {
             nextTimeout = Time::ZERO;
             handleTimeout();
-            continue;
         }
 
-        // icmp data
-        if (FD_ISSET(echo->getFd(), &fs))
-        {
-            bool reply;
-            uint16_t id, seq;
-            uint32_t ip;
+        if (result == 0)
+            continue;
 
-            int dataLength = echo->receive(ip, reply, id, seq);
-            if (dataLength != -1)
+        for (int socket = 0; socket < echo->socketCount(); socket++)
+        {
+            // icmp data
+            if (FD_ISSET(echo->getFd(socket), &fs))
             {
-                uint64_t nonce;
-                unsigned char *key;
-                bool valid = handleEchoData(echo->getReceiveBuffer(), dataLength, ip, reply, id, seq, nonce, key);
-                if (!valid && !reply && answerEcho)
+                bool reply;
+                uint16_t id, seq;
+                uint32_t ip;
+                Echo::Route route;
+
+                int dataLength = echo->receive(socket, ip, reply, id, seq, route);
+                if (dataLength != -1)
                 {
-                    memcpy(echo->sendPayloadBuffer(), echo->receivePayloadBuffer(), dataLength);
-                    echo->send(dataLength, ip, true, id, seq, -1, NULL);
+                    bool valid = handleEchoData(dataLength, ip, reply, id, seq, route);
+                    if (!valid && !reply && answerEcho)
+                    {
+                        memcpy(echo->sendPayloadBuffer(), echo->receivePayloadBuffer(), dataLength);
+                        echo->send(dataLength, ip, true, id, seq, route);
+                    }
                 }
             }
+
+            // the same echoes in udp datagrams
+            if (echo->getUdpFd(socket) != -1 && FD_ISSET(echo->getUdpFd(socket), &fs))
+            {
+                bool reply;
+                uint16_t id, seq;
+                uint32_t ip;
+                Echo::Route route;
+
+                int dataLength = echo->receiveUdp(socket, ip, reply, id, seq, route);
+                if (dataLength != -1)
+                    handleEchoData(dataLength, ip, reply, id, seq, route);
+            }
         }
 
         // data from tun
@@ -182,9 +548,28 @@ void Worker::run()
             if (dataLength != -1)
                 handleTunData(dataLength, sourceIp, destIp);
         }
+
+        handleStreams(fs, ws);
     }
 }
 
+void Worker::logStatistics()
+{
+    if (pacer.isEnabled())
+        syslog(LOG_INFO, "pacing: %d echoes/s, burst %d, %d queued, %u delayed, %u dropped",
+               pacer.getRate(), pacer.getBurst(), (int)sendQueue.size(), delayedEchoes, droppedEchoes);
+
+    if (compressor.getCompressed() != 0 || compressor.getSkipped() != 0 || compressor.getIncompressible() != 0)
+        syslog(LOG_INFO, "compression: %u packets compressed, %u skipped, %u incompressible, "
+               "%llu kB to %llu kB, %d ms cpu",
+               compressor.getCompressed(), compressor.getSkipped(), compressor.getIncompressible(),
+               (unsigned long long)(compressor.getBytesIn() / 1000),
+               (unsigned long long)(compressor.getBytesOut() / 1000), compressor.getCpuTime());
+
+    if (mssClamped != 0)
+        syslog(LOG_INFO, "mss: %u syn segments clamped to fit the tunnel", mssClamped);
+}
+
 void Worker::stop()
 {
     alive = false;
@@ -23,9 +23,19 @@
 #include "time.h"
 #include "echo.h"
 #include "tun.h"
+#include "pacer.h"
+#include "fec.h"
+#include "arq.h"
+#include "replay.h"
+#include "compress.h"
+#include "headers.h"
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/select.h>
 #include <nacl/crypto_stream_salsa20.h>
 
 class Worker
@@ -38,9 +48,22 @@ public:
     virtual void run();
     virtual void stop();
 
-    static int headerSize() { return sizeof(TunnelHeader); }
+    void requestStatistics() { statisticsRequested = 1; }
+    void setPacing(int rate, int burst, bool adaptive) { pacer.setRate(rate, burst, adaptive); }
+    void setFec(int groupSize, bool automatic) { fecGroupSize = groupSize; fecAutomatic = automatic; }
+    void setMssClamping(bool enabled) { mssClamping = enabled; }
+    void setReservedRoom(int bytes) { reservedRoom = bytes; }
+
+    static int headerSize() { return sizeof(PacketCounter) + sizeof(TunnelHeader); }
+
+    // room for the fec or arq header in front of a tunneled packet
+    static int frameOverhead() { return Fec::overhead() > Arq::overhead() ? Fec::overhead() : Arq::overhead(); }
 
 protected:
+    // every echo starts with a packet counter sent in the clear, the nonce
+    // for the encrypted rest is derived from it and the connection nonce
+    typedef uint32_t PacketCounter;
+
     struct TunnelHeader
     {
         struct Magic
@@ -67,31 +90,98 @@ protected:
             TYPE_CHALLENGE_ERROR    = 6,
             TYPE_DATA                = 7,
             TYPE_POLL                = 8,
-            TYPE_SERVER_FULL        = 9
+            TYPE_SERVER_FULL        = 9,
+            TYPE_FEC_DATA            = 10,
+            TYPE_FEC_PARITY            = 11,
+            TYPE_ARQ_DATA            = 12,
+            TYPE_ARQ_ACK            = 13,
+            TYPE_PROBE                = 14,
+            TYPE_ARQ_STREAM            = 15  // a StreamRelay frame, sent with arq
+        };
+
+        enum Flags
+        {
+            FLAG_COMPRESSED            = 0x80, // set in the type, the payload is deflated
+            FLAG_FIELDS                = 0x40  // only in a CompactHeader, optional fields follow
         };
     }; // size = 5
 
-    virtual bool handleEchoData(char *data, int dataLength,
-                                uint32_t realIp, bool reply, uint16_t id,
-                                uint16_t seq, uint64_t& nonce, unsigned char* key) 
-                                { return true; }
+    // the shorter framing of version 2, negotiated on connecting. the counter
+    // is sent truncated and expanded by the receiver, which saves a byte. the
+    // magic stays whole, it is all that tells our echoes from others with the
+    // same id, as the encryption is not authenticated.
+    // with FLAG_FIELDS set the header is followed by the length of optional
+    // fields as a varint, receivers skip those they do not know.
+    struct CompactHeader
+    {
+        uint8_t counter[3]; // low bits of the packet counter, in the clear
+        char check[4];      // the magic
+        uint8_t type;       // with flags, like that of TunnelHeader
+
+        static const uint8_t VERSION = 2;
+    }; // size = 8
+
+    // encryption state of a connection
+    struct Session
+    {
+        Session() : nonce(0), sendCounter(0), compression(false), compactHeader(false) { }
+
+        uint64_t nonce; // chosen by the client for every connection
+        unsigned char key[crypto_stream_salsa20_KEYBYTES];
+        uint32_t sendCounter;
+        ReplayWindow replayWindow;
+        bool compression; // tunneled packets are sent compressed where they shrink
+        bool compactHeader; // echoes are sent with a CompactHeader, both are received
+    };
+
+    // echo held back by the pacer, already encrypted
+    struct QueuedEcho
+    {
+        std::vector<char> data;
+        uint32_t realIp;
+        bool reply;
+        uint16_t id;
+        uint16_t seq;
+        Echo::Route route;
+    };
+
+    virtual bool handleEchoData(int dataLength, uint32_t realIp, bool reply,
+                                uint16_t id, uint16_t seq, const Echo::Route &route) { return true; }
     virtual void handleTunData(int dataLength, uint32_t sourceIp,
                                uint32_t destIp) { } // to echoSendPayloadBuffer
     virtual void handleTimeout() { }
+    virtual void deliverData(int length) { sendToTun(length); } // from echoReceivePayloadBuffer
+    virtual bool forwardPacket(int length) { return false; } // true if it does not go to the tunnel device
+    virtual void addStreamFds(fd_set &readFds, fd_set &writeFds, int &maxFd) { }
+    virtual void handleStreams(const fd_set &readFds, const fd_set &writeFds) { }
+    virtual void logStatistics();
 
-    void sendEcho(const TunnelHeader::Magic &magic, int type, int length,
+    bool sendEcho(const TunnelHeader::Magic &magic, int type, int length,
                   uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
-                  const uint64_t &nonce, const unsigned char *key);
+                  const Echo::Route &route, Session &session); // false if it failed
     void sendToTun(int length); // from echoReceivePayloadBuffer
+    int decodeHeaders(int length); // in echoReceivePayloadBuffer, 0 if it is dropped
+    void clampMss(char *packet, int length, int mtu); // of tcp syn segments, so they fit into the mtu
+
+    uint32_t receivedCounter();
+    void decryptEcho(int dataLength, bool reply, const uint64_t &nonce,
+                     const unsigned char *key);
+    bool openCompactEcho(int &dataLength, bool reply, Session &session,
+                         const TunnelHeader::Magic &magic); // false and unchanged if it is not one
+    bool decompressEcho(TunnelHeader &header, int &dataLength); // false if invalid
+    TunnelHeader &receivedHeader() { return *(TunnelHeader *)(echo->receivePayloadBuffer() +
+                                                               sizeof(PacketCounter)); }
+    void handleFecData(Fec::Decoder &decoder, int type, int dataLength);
 
     void setTimeout(Time delta);
+    void setTimeoutIfEarlier(Time delta);
 
     char *echoSendPayloadBuffer() { return echo->sendPayloadBuffer() +
-                                    sizeof(TunnelHeader); }
+                                    sizeof(PacketCounter) + sizeof(TunnelHeader); }
     char *echoReceivePayloadBuffer() { return echo->receivePayloadBuffer() +
-                                       sizeof(TunnelHeader); }
+                                       sizeof(PacketCounter) + sizeof(TunnelHeader); }
 
-    int payloadBufferSize() { return tunnelMtu; }
+    int payloadBufferSize() { return tunnelMtu + reservedRoom; }
 
     void dropPrivileges();
 
@@ -100,17 +190,39 @@ protected:
     bool alive;
     bool answerEcho;
     int tunnelMtu;
+    int reservedRoom; // left out of the tunnel mtu for the headers of the features in use
     int maxTunnelHeaderSize;
     uid_t uid;
     gid_t gid;
 
     bool privilegesDropped;
+    volatile sig_atomic_t statisticsRequested; // set from the SIGUSR1 handler
 
     Time now;
+
+    Pacer pacer;
+    Compressor compressor;
+    HeaderCompression::Decoder *headerDecoder; // of the peer that sent the echo, NULL if it sends full headers
+    int fecGroupSize;
+    bool fecAutomatic;
+
+    bool mssClamping;
+    unsigned int mssClamped;
 private:
     int readIcmpData(int *realIp, int *id, int *seq);
 
+    static void crypt(char *data, int length, const uint64_t &nonce, uint32_t counter,
+                      bool reply, const unsigned char *key);
+
+    void queueEcho(int length, uint32_t realIp, bool reply, uint16_t id, uint16_t seq,
+                   const Echo::Route &route);
+    void flushSendQueue();
+
     Time nextTimeout;
+
+    std::deque<QueuedEcho> sendQueue;
+    unsigned int delayedEchoes;
+    unsigned int droppedEchoes;
 };
 
 #endif